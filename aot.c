@@ -0,0 +1,534 @@
+// Translates an assembled image to C ahead of time.
+//
+// Every basic block reachable from pc 0, the targets of direct branches and
+// calls, the instructions after calls, skips and portw, and anything in the
+// label map becomes a labelled piece of one big aot_run function. Direct
+// branches jump straight to the block they target, indirect ones (ba, br,
+// calla, callr, ret) go through a switch over the pcs of all blocks. Pcs
+// without a block, and writes over translated code, fall back to the
+// interpreter in vm.c.
+//
+// The output includes aot_runtime.c and run.c, so it builds into a program
+// that takes the same options as run, minus the program file.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vm.h"
+
+#include "vm_utils.c"
+
+// same as the JIT, keeps one block from eating too much of a core's turn
+#define AOT_MAX_BLOCK_STEPS 64
+
+static vm_state vm;
+// with two bytes past the end for the operands of an instruction at 0xffff
+static uint8_t memory[VM_MEMORY_SIZE + 2];
+static size_t image_length;
+
+static bool is_entry[0x10000];
+static uint32_t block_index[0x10000];
+static uint32_t block_count;
+
+static uint16_t worklist[0x10000];
+static uint32_t worklist_count;
+static bool queued[0x10000];
+
+static void usage(void) {
+	fprintf(stderr, "Usage: aot <image> <output.c> [label map]\n");
+}
+
+static void queue(uint16_t pc) {
+	if (queued[pc]) return;
+	queued[pc] = true;
+	worklist[worklist_count++] = pc;
+}
+
+// only instructions entirely inside the image are translated
+static bool in_image(uint16_t pc) {
+	return (size_t)pc + 3 <= image_length;
+}
+
+#define OP (vm.memory[pc])
+#define R1_id (vm.memory[pc + 1] >> 4)
+#define R2_id (vm.memory[pc + 1] & 0x0f)
+#define R3_id (vm.memory[pc + 2] >> 4)
+#define R4_id (vm.memory[pc + 2] & 0x0f)
+#define B2 (vm.memory[pc + 2])
+#define D ((vm.memory[pc + 1] << 8) | vm.memory[pc + 2])
+#define SD ((int16_t)D)
+
+// ops that fault when R1 and R2 are the same register
+static bool needs_distinct_pair(uint8_t op) {
+	switch (op) {
+	case vm_op_Add: case vm_op_Subtract:
+	case vm_op_Increment: case vm_op_Decrement:
+	case vm_op_Unsigned_Multiply: case vm_op_Signed_Multiply:
+	case vm_op_Unsigned_Divide: case vm_op_Signed_Divide:
+	case vm_op_Compare_Signed: case vm_op_Compare_Unsigned: case vm_op_Compare_Equal:
+	case vm_op_Bit_Test_And_Set: case vm_op_Bit_Test_And_Clear:
+	case vm_op_Add_Pair: case vm_op_Subtract_Pair:
+	case vm_op_Shift_Left_Pair: case vm_op_Shift_Logical_Right_Pair:
+	case vm_op_Compare_Unsigned_Pair: case vm_op_Compare_Signed_Pair:
+	case vm_op_Read_Address_Four_Byte:
+		return true;
+	}
+	return false;
+}
+
+static bool always_faults(uint16_t pc) {
+	switch (OP) {
+	case vm_op_Copy_2: case vm_op_Copy_3:
+	case vm_op_Bit_Or: case vm_op_Bit_Xor: case vm_op_Bit_And:
+	case vm_op_Fault:
+		return true;
+	}
+	return OP >= vm_op_count || (needs_distinct_pair(OP) && R1_id == R2_id);
+}
+
+static bool ends_block(uint16_t pc) {
+	switch (OP) {
+	case vm_op_Branch_Immediate_Absolute: case vm_op_Branch_Immediate_Relative:
+	case vm_op_Branch_Absolute: case vm_op_Branch_Relative:
+	case vm_op_Skip_If_Zero: case vm_op_Skip_If_Non_Zero:
+	case vm_op_Call_Immediate_Relative: case vm_op_Call_Immediate_Absolute:
+	case vm_op_Call_Relative: case vm_op_Call_Absolute:
+	case vm_op_Return:
+	case vm_op_Port_Write:
+	case vm_op_Wait_Byte: case vm_op_Wait_Two_Byte:
+		return true;
+	}
+	return always_faults(pc);
+}
+
+// queues the pcs the instruction ending a block can continue at, indirect
+// targets can only be found through the label map
+static void queue_successors(uint16_t pc) {
+	switch (OP) {
+	case vm_op_Branch_Immediate_Absolute: queue(D); break;
+	case vm_op_Branch_Immediate_Relative: queue(pc + SD); break;
+	case vm_op_Skip_If_Zero:
+	case vm_op_Skip_If_Non_Zero:
+		queue(pc + 3);
+		queue(pc + 6);
+		break;
+	case vm_op_Call_Immediate_Relative: queue(pc + D); queue(pc + 3); break;
+	case vm_op_Call_Immediate_Absolute: queue(D); queue(pc + 3); break;
+	case vm_op_Call_Relative:
+	case vm_op_Call_Absolute:
+	case vm_op_Port_Write:
+	case vm_op_Wait_Byte: case vm_op_Wait_Two_Byte:
+		queue(pc + 3);
+		break;
+	}
+}
+
+static void find_blocks(void) {
+	while (worklist_count > 0) {
+		uint16_t const start = worklist[--worklist_count];
+		if (!in_image(start)) continue;
+		is_entry[start] = true;
+
+		uint16_t pc = start;
+		for (uint32_t steps = 0;; ++steps, pc += 3) {
+			if (steps == AOT_MAX_BLOCK_STEPS) { queue(pc); break; }
+			if (!in_image(pc)) break;
+			if (ends_block(pc)) { queue_successors(pc); break; }
+		}
+	}
+
+	for (uint32_t pc = 0; pc < 0x10000; ++pc)
+		if (is_entry[pc]) block_index[pc] = block_count++;
+}
+
+static void read_label_map(char const *file_name) {
+	FILE *file = fopen(file_name, "r");
+	if (!file) {
+		fprintf(stderr, "Could not open label map %s.\n", file_name);
+		exit(1);
+	}
+
+	unsigned offset;
+	while (fscanf(file, "%x %*s", &offset) == 1)
+		queue(offset);
+
+	if (!feof(file)) {
+		fprintf(stderr, "Label map %s is malformed (expected \"<hex offset> <name>\" lines).\n", file_name);
+		exit(1);
+	}
+	fclose(file);
+}
+
+// how many instructions the block at start has before it ends, runs into
+// another block or off the translated code
+static uint32_t block_length(uint16_t start) {
+	uint32_t steps = 0;
+	for (uint16_t pc = start; steps < AOT_MAX_BLOCK_STEPS && in_image(pc) && (pc == start || !is_entry[pc]); pc += 3) {
+		++steps;
+		if (ends_block(pc)) break;
+	}
+	return steps;
+}
+
+static void emit_jump(FILE *out, uint16_t target) {
+	if (is_entry[target]) fprintf(out, "aot_jump(%u, 0x%04x);", block_index[target], target);
+	else fprintf(out, "pc = 0x%04x; goto dispatch;", target);
+}
+
+// branches back are where idle loops are found, like jump in vm_interp.c.
+// Idle loops only ever branch back with immediates, so that is all we look at.
+static void emit_branch(FILE *out, uint16_t pc, uint16_t target) {
+	if (target <= pc) fprintf(out, "aot_idle_check(0x%04x); ", target);
+	emit_jump(out, target);
+}
+
+// mirrors the handlers in vm_interp.c, unretired is how many instructions
+// of the block are left after this one
+static void emit_instruction(FILE *out, uint16_t pc, uint32_t unretired) {
+	uint16_t const next = pc + 3;
+	fprintf(out, "\t// %04x: %s\n\t", pc, vm_disasm(OP, vm.memory[pc + 1], vm.memory[pc + 2]));
+
+	if (needs_distinct_pair(OP) && R1_id == R2_id) {
+		if (OP == vm_op_Unsigned_Divide || OP == vm_op_Signed_Divide)
+			fprintf(out, "if (*R(%u) == 0) aot_fault(0x%04x, vm_fault_divide_by_zero, %u); ", R4_id, pc, unretired);
+		fprintf(out, "aot_fault(0x%04x, vm_fault_illegal_instruction, %u);\n", pc, unretired);
+		return;
+	}
+
+	switch (OP) {
+	case vm_op_Nop: fprintf(out, ";"); break;
+
+	case vm_op_Load_Immediate_Byte:    fprintf(out, "*R(%u) = 0x%02x;", R1_id, B2); break;
+	case vm_op_Shift_In_Byte:          fprintf(out, "*R(%u) = (*R(%u) << 8) | 0x%02x;", R1_id, R1_id, B2); break;
+	case vm_op_Shift_Left:             fprintf(out, "*R(%u) <<= *R(%u);", R1_id, R2_id); break;
+	case vm_op_Shift_Logical_Right:    fprintf(out, "*R(%u) >>= *R(%u);", R1_id, R2_id); break;
+	case vm_op_Shift_Arithmetic_Right: fprintf(out, "*SR(%u) >>= *R(%u);", R1_id, R2_id); break;
+
+	case vm_op_Copy: fprintf(out, "*R(%u) = *R(%u);", R1_id, R2_id); break;
+
+	case vm_op_Rotate_2:
+		fprintf(out, "{ uint16_t v1 = *R(%u), v2 = *R(%u); *R(%u) = v2; *R(%u) = v1; }", R1_id, R2_id, R1_id, R2_id);
+		break;
+	case vm_op_Rotate_3:
+		fprintf(out, "{ uint16_t v1 = *R(%u), v2 = *R(%u), v3 = *R(%u); *R(%u) = v2; *R(%u) = v3; *R(%u) = v1; }",
+			R1_id, R2_id, R3_id, R1_id, R2_id, R3_id);
+		break;
+	case vm_op_Rotate_4:
+		fprintf(out, "{ uint16_t v1 = *R(%u), v2 = *R(%u), v3 = *R(%u), v4 = *R(%u); *R(%u) = v2; *R(%u) = v3; *R(%u) = v4; *R(%u) = v1; }",
+			R1_id, R2_id, R3_id, R4_id, R1_id, R2_id, R3_id, R4_id);
+		break;
+
+	case vm_op_Add:
+	case vm_op_Subtract:
+	case vm_op_Unsigned_Multiply:
+		fprintf(out, "{ uint32_t result = *R(%u) %c *R(%u); *R(%u) = result >> 16; *R(%u) = result & 0xffff; }",
+			R3_id, OP == vm_op_Add ? '+' : OP == vm_op_Subtract ? '-' : '*', R4_id, R1_id, R2_id);
+		break;
+	case vm_op_Increment:
+	case vm_op_Decrement:
+		fprintf(out, "{ uint32_t result = *R(%u) %c 0x%02x; *R(%u) = result >> 16; *R(%u) = result & 0xffff; }",
+			R2_id, OP == vm_op_Increment ? '+' : '-', B2, R1_id, R2_id);
+		break;
+	case vm_op_Signed_Multiply:
+		fprintf(out, "{ union { int32_t s; uint32_t u; } result = { .s = *SR(%u) * *SR(%u) }; *R(%u) = result.u >> 16; *R(%u) = result.u & 0xffff; }",
+			R3_id, R4_id, R1_id, R2_id);
+		break;
+	case vm_op_Unsigned_Divide:
+		fprintf(out, "if (*R(%u) == 0) aot_fault(0x%04x, vm_fault_divide_by_zero, %u);\n\t", R4_id, pc, unretired);
+		fprintf(out, "*R(%u) = *R(%u) / *R(%u); *R(%u) = *R(%u) %% *R(%u);", R1_id, R3_id, R4_id, R2_id, R3_id, R4_id);
+		break;
+	case vm_op_Signed_Divide:
+		fprintf(out, "if (*R(%u) == 0) aot_fault(0x%04x, vm_fault_divide_by_zero, %u);\n\t", R4_id, pc, unretired);
+		fprintf(out, "{ union { int16_t s; uint16_t u; } div = { .s = *SR(%u) / *SR(%u) }, rem = { .s = *SR(%u) %% *SR(%u) }; *R(%u) = div.u; *R(%u) = rem.u; }",
+			R3_id, R4_id, R3_id, R4_id, R1_id, R2_id);
+		break;
+
+	case vm_op_Compare_Signed:
+	case vm_op_Compare_Unsigned:
+	case vm_op_Compare_Equal: {
+		char const *operand = OP == vm_op_Compare_Signed ? "SR" : "R";
+		fprintf(out, "{ bool cmp = *%s(%u) %s *%s(%u); *R(%u) = cmp; *R(%u) = !cmp; }",
+			operand, R3_id, OP == vm_op_Compare_Equal ? "==" : "<=", operand, R4_id, R1_id, R2_id);
+		break;
+	}
+
+	case vm_op_Branch_Immediate_Absolute: emit_branch(out, pc, D); break;
+	case vm_op_Branch_Immediate_Relative: emit_branch(out, pc, pc + SD); break;
+	case vm_op_Branch_Absolute:           fprintf(out, "pc = *R(%u); goto dispatch;", R1_id); break;
+	case vm_op_Branch_Relative:           fprintf(out, "pc = 0x%04x + *SR(%u); goto dispatch;", pc, R1_id); break;
+
+	case vm_op_Skip_If_Zero:
+	case vm_op_Skip_If_Non_Zero:
+		fprintf(out, "if (*R(%u) %s 0) ", R1_id, OP == vm_op_Skip_If_Zero ? "==" : "!=");
+		emit_jump(out, pc + 6);
+		fprintf(out, "\n\t");
+		emit_jump(out, next);
+		break;
+
+	case vm_op_Read_Address_Byte:
+		fprintf(out, "*R(%u) = vm_load_byte(vm, *R(%u));", R1_id, R2_id);
+		break;
+	case vm_op_Read_Address_Two_Byte:
+		fprintf(out, "*R(%u) = vm_load_two_byte(vm, *R(%u));", R1_id, R2_id);
+		break;
+	case vm_op_Write_Address_Byte:
+		fprintf(out, "vm_store_byte(vm, *R(%u), *R(%u)); aot_wrote(aot_note_write(vm, *R(%u), 1), 0x%04x, %u);",
+			R1_id, R2_id, R1_id, next, unretired);
+		break;
+	case vm_op_Write_Address_Two_Byte:
+		fprintf(out, "vm_store_two_byte(vm, *R(%u), *R(%u)); aot_wrote(aot_note_write(vm, *R(%u), 2), 0x%04x, %u);",
+			R1_id, R2_id, R1_id, next, unretired);
+		break;
+
+	case vm_op_Push: fprintf(out, "aot_wrote(aot_push(vm, &regs[15], *R(%u)), 0x%04x, %u);", R1_id, next, unretired); break;
+	case vm_op_Pop:  fprintf(out, "*R(%u) = aot_pop(vm, &regs[15]);", R1_id); break;
+
+	case vm_op_Port_Write:
+		fprintf(out, "if (vm->ports[0x%02x].write) vm->ports[0x%02x].write(vm->ports[0x%02x].context, 0x%02x, *R(%u));\n\t", B2, B2, B2, B2, R1_id);
+		fprintf(out, "if (vm->ports[0x%02x].stop) { pc = 0x%04x; stopped_because = vm_run_port_write; goto stop; }\n\t", B2, next);
+		emit_jump(out, next);
+		break;
+	case vm_op_Port_Read:
+		fprintf(out, "if (vm->ports[0x%02x].read) *R(%u) = vm->ports[0x%02x].read(vm->ports[0x%02x].context, 0x%02x);", B2, R1_id, B2, B2, B2);
+		break;
+
+	// the block ends here, so a push over translated code needs no special care
+	case vm_op_Call_Immediate_Relative:
+		fprintf(out, "aot_push(vm, &regs[15], 0x%04x); ", pc);
+		emit_branch(out, pc, pc + D);
+		break;
+	case vm_op_Call_Immediate_Absolute:
+		fprintf(out, "aot_push(vm, &regs[15], 0x%04x); ", pc);
+		emit_branch(out, pc, D);
+		break;
+	case vm_op_Call_Relative:
+		fprintf(out, "aot_push(vm, &regs[15], 0x%04x); pc = 0x%04x + *SR(%u); goto dispatch;", pc, pc, R1_id);
+		break;
+	case vm_op_Call_Absolute:
+		fprintf(out, "aot_push(vm, &regs[15], 0x%04x); pc = *R(%u); goto dispatch;", pc, R1_id);
+		break;
+	case vm_op_Return: fprintf(out, "pc = aot_pop(vm, &regs[15]) + 3; goto dispatch;"); break;
+
+	case vm_op_Core:        fprintf(out, "*R(%u) = core_index;", R1_id); break;
+	case vm_op_Count_Cores: fprintf(out, "*R(%u) = vm->core_count;", R1_id); break;
+
+	case vm_op_Fetch_And_Add_Byte:
+		fprintf(out, "{ uint16_t v2 = *R(%u); uint8_t v3 = *R(%u); *R(%u) = atomic_fetch_add_explicit(vm_atomic_byte(vm, v2), v3, memory_order_relaxed); aot_wrote(aot_note_write(vm, v2, 1), 0x%04x, %u); }",
+			R2_id, R3_id, R1_id, next, unretired);
+		break;
+	case vm_op_Fetch_And_Add_Two_Byte:
+	case vm_op_Exchange_Byte:
+	case vm_op_Exchange_Two_Byte: {
+		bool const two_byte = OP != vm_op_Exchange_Byte;
+		fprintf(out, "{ uint16_t address = *R(%u); ", R2_id);
+		if (two_byte) fprintf(out, "if (address & 1) aot_fault(0x%04x, vm_fault_misaligned_atomic, %u); ", pc, unretired);
+		fprintf(out, "*R(%u) = atomic_%s_explicit(vm_atomic_%s(vm, address), *R(%u), memory_order_relaxed); aot_wrote(aot_note_write(vm, address, %u), 0x%04x, %u); }",
+			R1_id, OP == vm_op_Fetch_And_Add_Two_Byte ? "fetch_add" : "exchange", two_byte ? "two_byte" : "byte", R3_id, two_byte ? 2 : 1, next, unretired);
+		break;
+	}
+	case vm_op_Compare_And_Swap_Byte:
+	case vm_op_Compare_And_Swap_Two_Byte: {
+		bool const two_byte = OP == vm_op_Compare_And_Swap_Two_Byte;
+		fprintf(out, "{ uint16_t address = *R(%u); %s old = *R(%u); ", R2_id, two_byte ? "uint16_t" : "uint8_t", R3_id);
+		if (two_byte) fprintf(out, "if (address & 1) aot_fault(0x%04x, vm_fault_misaligned_atomic, %u); ", pc, unretired);
+		fprintf(out, "bool swapped = atomic_compare_exchange_strong_explicit(vm_atomic_%s(vm, address), &old, *R(%u), memory_order_relaxed, memory_order_relaxed); *R(%u) = old; ",
+			two_byte ? "two_byte" : "byte", R4_id, R1_id);
+		fprintf(out, "aot_wrote(swapped && aot_note_write(vm, address, %u), 0x%04x, %u); }", two_byte ? 2 : 1, next, unretired);
+		break;
+	}
+	case vm_op_Wait_Byte:
+	case vm_op_Wait_Two_Byte:
+		fprintf(out, "if (vm_wait(vm, core_index, *R(%u), *R(%u), %s)) { pc = 0x%04x; stopped_because = vm_run_parked; goto stop; }\n\t",
+			R1_id, R2_id, OP == vm_op_Wait_Two_Byte ? "true" : "false", next);
+		emit_jump(out, next);
+		break;
+	case vm_op_Notify: fprintf(out, "vm_notify(vm, *R(%u));", R1_id); break;
+
+	case vm_op_Fence_Acquire: fprintf(out, "atomic_thread_fence(memory_order_acquire);"); break;
+	case vm_op_Fence_Release: fprintf(out, "atomic_thread_fence(memory_order_release);"); break;
+	case vm_op_Fence:         fprintf(out, "atomic_thread_fence(memory_order_seq_cst);"); break;
+
+	// the vm notes what these write itself, only our blocks are left
+	case vm_op_Memory_Copy:
+	case vm_op_Memory_Fill:
+		fprintf(out, "{ uint16_t to = *R(%u), length = *R(%u); vm_memory_%s(vm, to, *R(%u), length); aot_wrote(aot_drop_written(to, length), 0x%04x, %u); }",
+			R1_id, R3_id, OP == vm_op_Memory_Copy ? "copy" : "fill", R2_id, next, unretired);
+		break;
+	case vm_op_Memory_Compare:
+	case vm_op_Memory_Scan:
+		fprintf(out, "*R(%u) = vm_memory_%s(vm, *R(%u), *R(%u), *R(%u));",
+			R1_id, OP == vm_op_Memory_Compare ? "compare" : "scan", R2_id, R3_id, R4_id);
+		break;
+
+	case vm_op_Population_Count:     fprintf(out, "*R(%u) = vm_popcount(*R(%u));", R1_id, R2_id); break;
+	case vm_op_Count_Leading_Zeros:  fprintf(out, "*R(%u) = vm_leading_zeros(*R(%u));", R1_id, R2_id); break;
+	case vm_op_Count_Trailing_Zeros: fprintf(out, "*R(%u) = vm_trailing_zeros(*R(%u));", R1_id, R2_id); break;
+	case vm_op_Byte_Swap:            fprintf(out, "*R(%u) = *R(%u) << 8 | *R(%u) >> 8;", R1_id, R2_id, R2_id); break;
+	case vm_op_Bit_Test_And_Set:
+	case vm_op_Bit_Test_And_Clear:
+		fprintf(out, "{ uint16_t bit = 1 << (*R(%u) & 15), value = *R(%u); *R(%u) = (value & bit) != 0; *R(%u) = value %s; }",
+			R3_id, R2_id, R1_id, R2_id, OP == vm_op_Bit_Test_And_Set ? "| bit" : "& ~bit");
+		break;
+
+	case vm_op_Add_Pair:
+	case vm_op_Subtract_Pair:
+		fprintf(out, "{ uint32_t result = PAIR(%u, %u) %c PAIR(%u, %u); *R(%u) = result >> 16; *R(%u) = result & 0xffff; }",
+			R1_id, R2_id, OP == vm_op_Add_Pair ? '+' : '-', R3_id, R4_id, R1_id, R2_id);
+		break;
+	case vm_op_Shift_Left_Pair:
+	case vm_op_Shift_Logical_Right_Pair:
+		fprintf(out, "{ uint32_t result = PAIR(%u, %u) %s (*R(%u) & 31); *R(%u) = result >> 16; *R(%u) = result & 0xffff; }",
+			R1_id, R2_id, OP == vm_op_Shift_Left_Pair ? "<<" : ">>", R3_id, R1_id, R2_id);
+		break;
+	case vm_op_Compare_Unsigned_Pair:
+		fprintf(out, "{ bool cmp = PAIR(%u, %u) <= PAIR(%u, %u); *R(%u) = cmp; *R(%u) = !cmp; }",
+			R1_id, R2_id, R3_id, R4_id, R1_id, R2_id);
+		break;
+	case vm_op_Compare_Signed_Pair:
+		fprintf(out, "{ union { uint32_t u; int32_t s; } a = { .u = PAIR(%u, %u) }, b = { .u = PAIR(%u, %u) }; bool cmp = a.s <= b.s; *R(%u) = cmp; *R(%u) = !cmp; }",
+			R1_id, R2_id, R3_id, R4_id, R1_id, R2_id);
+		break;
+	case vm_op_Read_Address_Four_Byte:
+		fprintf(out, "{ uint32_t value = aot_read_four_byte(vm, *R(%u)); *R(%u) = value >> 16; *R(%u) = value & 0xffff; }",
+			R3_id, R1_id, R2_id);
+		break;
+	case vm_op_Write_Address_Four_Byte:
+		fprintf(out, "aot_wrote(aot_write_four_byte(vm, *R(%u), PAIR(%u, %u)), 0x%04x, %u);",
+			R1_id, R2_id, R3_id, next, unretired);
+		break;
+
+	case vm_op_Fault: fprintf(out, "aot_fault(0x%04x, vm_fault_explicitly_requested, %u);", pc, unretired); break;
+
+	default: fprintf(out, "aot_fault(0x%04x, vm_fault_illegal_instruction, %u);", pc, unretired); break;
+	}
+	fprintf(out, "\n");
+}
+
+static void emit_block(FILE *out, uint16_t start) {
+	uint32_t const steps = block_length(start);
+	fprintf(out, "\npc_0x%04x: // block %u\n\tsteps += %u;\n", start, block_index[start], steps);
+
+	uint16_t pc = start;
+	for (uint32_t i = 0; i < steps; ++i, pc += 3)
+		emit_instruction(out, pc, steps - i - 1);
+
+	pc -= 3;
+	if (ends_block(pc)) return;
+
+	// ran into another block or the end of the translated code
+	pc += 3;
+	fprintf(out, "\t");
+	emit_jump(out, pc);
+	fprintf(out, "\n");
+}
+
+static void emit_program(FILE *out, char const *image_name) {
+	fprintf(out, "// Generated by aot from %s, do not edit. Build it with the sources of\n", image_name);
+	fprintf(out, "// the vm on the include path:\n");
+	fprintf(out, "//\n");
+	fprintf(out, "//     cc -O2 -std=c11 -I<lil-vm> <lil-vm>/vm.c <lil-vm>/common_ports.c <lil-vm>/host.c <lil-vm>/sv.c <this file>\n\n");
+	fprintf(out, "#include <stdint.h>\n#include \"vm.h\"\n\n");
+	fprintf(out, "#define AOT_BLOCK_COUNT %u\n#include \"aot_runtime.c\"\n\n", block_count);
+
+	fprintf(out, "static uint8_t const aot_image[%zu] = {", image_length);
+	for (size_t i = 0; i < image_length; ++i)
+		fprintf(out, "%s0x%02x,", i % 12 == 0 ? "\n\t" : " ", vm.memory[i]);
+	fprintf(out, "\n};\n\n");
+
+	fprintf(out, "static aot_block const aot_blocks[AOT_BLOCK_COUNT] = {\n");
+	for (uint32_t pc = 0; pc < 0x10000; ++pc)
+		if (is_entry[pc]) fprintf(out, "\t{ 0x%04x, %u, %u },\n", pc, 3 * block_length(pc), block_length(pc));
+	fprintf(out, "};\n\n");
+
+	fprintf(out,
+		"static vm_run_result aot_run(vm_state *vm, uint16_t core_index, uint32_t max_steps, uint32_t *steps_run) {\n"
+		"\tuint32_t ignored;\n"
+		"\tif (!steps_run) steps_run = &ignored;\n"
+		"\t*steps_run = 0;\n"
+		"\tvm_core *const core = &vm->cores[core_index];\n"
+		"\tif (core->fault != vm_fault_none)\n"
+		"\t\treturn vm_run_faulted;\n"
+		"\tif (vm_core_parked(core))\n"
+		"\t\treturn vm_run_parked;\n"
+		"\tcall_once(&aot_cover_once, aot_init_cover);\n"
+		"\n"
+		"\tuint16_t pc = core->pc;\n"
+		"\tuint16_t regs[16];\n"
+		"\tmemcpy(regs, core->registers, sizeof regs);\n"
+		"\tvm_run_result stopped_because = vm_run_budget_exhausted;\n"
+		"\tuint32_t steps = 0;\n"
+		"\tbool const idle_parking = vm->idle_parking;\n"
+		"\tvm_idle_detector idle = { .head = pc, .rounds = 0 };\n"
+		"\n"
+		"dispatch:\n"
+		"\twhile (steps != max_steps) {\n"
+		"\t\tswitch (pc) {\n");
+	for (uint32_t pc = 0; pc < 0x10000; ++pc)
+		if (is_entry[pc])
+			fprintf(out, "\t\tcase 0x%04x: if (aot_can_enter(%u, max_steps - steps)) goto pc_0x%04x; break;\n", pc, block_index[pc], pc);
+	fprintf(out,
+		"\t\t}\n"
+		"\n"
+		"\t\tcore->pc = pc;\n"
+		"\t\tmemcpy(core->registers, regs, sizeof regs);\n"
+		"\t\tuint32_t ran;\n"
+		"\t\tstopped_because = aot_interpret_one(vm, core_index, &ran);\n"
+		"\t\tsteps += ran;\n"
+		"\t\tif (stopped_because != vm_run_budget_exhausted) { *steps_run = steps; return stopped_because; }\n"
+		"\t\tpc = core->pc;\n"
+		"\t\tmemcpy(regs, core->registers, sizeof regs);\n"
+		"\t}\n"
+		"\tgoto stop;\n");
+
+	for (uint32_t pc = 0; pc < 0x10000; ++pc)
+		if (is_entry[pc]) emit_block(out, pc);
+
+	fprintf(out,
+		"\n"
+		"stop:\n"
+		"\tcore->pc = pc;\n"
+		"\tmemcpy(core->registers, regs, sizeof regs);\n"
+		"\t*steps_run = steps;\n"
+		"\treturn stopped_because;\n"
+		"}\n"
+		"\n"
+		"#define RUN_EMBEDDED_IMAGE aot_image\n"
+		"#define RUN_VM_RUN aot_run\n"
+		"#include \"run.c\"\n");
+}
+
+int main(int argc, char **argv) {
+	if (argc != 3 && argc != 4) {
+		usage();
+		return 1;
+	}
+
+	vm.memory = memory;
+	image_length = read_file_to_vm_memory(&vm, argv[1]);
+	// nothing writes it here, so a copy is as good as a mapped mirror
+	memcpy(&memory[VM_MEMORY_SIZE], memory, 2);
+	queue(0);
+	if (argc == 4)
+		read_label_map(argv[3]);
+	find_blocks();
+
+	if (block_count == 0) {
+		fprintf(stderr, "Found no code to translate in %s.\n", argv[1]);
+		return 1;
+	}
+
+	FILE *out = fopen(argv[2], "w");
+	if (!out) {
+		fprintf(stderr, "Could not open %s for writing.\n", argv[2]);
+		return 1;
+	}
+	emit_program(out, argv[1]);
+	if (fclose(out) != 0) {
+		fprintf(stderr, "Could not write %s.\n", argv[2]);
+		return 1;
+	}
+
+	printf("Translated %u blocks to %s\n", block_count, argv[2]);
+	return 0;
+}
@@ -0,0 +1,179 @@
+// Support code for the C files written by the aot tool, included by them
+// after defining AOT_BLOCK_COUNT. Expects vm.h to be included already.
+//
+// Translated blocks assume the code they were made from is still in
+// memory. Every write is checked against the bytes covered by valid blocks,
+// and blocks with a changed byte are dropped for good, which sends their
+// pcs back to the interpreter.
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <string.h>
+#include <threads.h>
+
+typedef struct aot_block {
+	uint16_t start;
+	uint8_t bytes; // of guest code covered
+	uint8_t steps; // instructions run when the whole block runs
+} aot_block;
+
+static aot_block const aot_blocks[AOT_BLOCK_COUNT];
+static _Atomic bool aot_block_invalid[AOT_BLOCK_COUNT];
+
+// how many valid blocks cover each byte of memory
+static _Atomic uint8_t aot_cover[0x10000];
+static once_flag aot_cover_once = ONCE_FLAG_INIT;
+
+static void aot_init_cover(void) {
+	for (uint32_t b = 0; b < AOT_BLOCK_COUNT; ++b)
+		for (uint32_t i = 0; i < aot_blocks[b].bytes; ++i)
+			atomic_fetch_add_explicit(&aot_cover[(uint16_t)(aot_blocks[b].start + i)], 1, memory_order_relaxed);
+}
+
+static bool aot_invalidate_byte(uint16_t address) {
+	bool invalidated = false;
+	for (uint32_t b = 0; b < AOT_BLOCK_COUNT; ++b) {
+		if ((uint16_t)(address - aot_blocks[b].start) >= aot_blocks[b].bytes) continue;
+		if (atomic_exchange_explicit(&aot_block_invalid[b], true, memory_order_relaxed)) continue;
+
+		for (uint32_t i = 0; i < aot_blocks[b].bytes; ++i)
+			atomic_fetch_sub_explicit(&aot_cover[(uint16_t)(aot_blocks[b].start + i)], 1, memory_order_relaxed);
+		invalidated = true;
+	}
+	return invalidated;
+}
+
+// drops the blocks covering a write, returns whether there were any
+// (possibly the running one)
+static bool aot_drop_written(uint16_t address, uint16_t length) {
+	bool invalidated = false;
+	for (uint16_t i = 0; i < length; ++i)
+		if (atomic_load_explicit(&aot_cover[(uint16_t)(address + i)], memory_order_relaxed))
+			invalidated |= aot_invalidate_byte(address + i);
+	return invalidated;
+}
+
+// must be called after every write to guest memory the vm didn't note
+// itself (as vm_run and vm_memory_copy do), returns whether it dropped any
+// blocks
+static inline bool aot_note_write(vm_state *vm, uint16_t address, uint16_t length) {
+	if (vm->decode_cache || vm->jit || vm->idle_parking)
+		vm_invalidate_decoded(vm, address, length);
+	return aot_drop_written(address, length);
+}
+
+static inline bool aot_can_enter(uint32_t block, uint32_t steps_left) {
+	return aot_blocks[block].steps <= steps_left
+		&& !atomic_load_explicit(&aot_block_invalid[block], memory_order_relaxed);
+}
+
+static inline bool aot_push(vm_state *vm, uint16_t *sp, uint16_t value) {
+	*sp += 2;
+	uint16_t cursor = *sp;
+	vm_store_two_byte(vm, cursor, value);
+	return aot_note_write(vm, cursor, 2);
+}
+
+static inline uint16_t aot_pop(vm_state *vm, uint16_t *sp) {
+	uint16_t cursor = *sp;
+	uint16_t result = vm_load_two_byte(vm, cursor);
+	*sp -= 2;
+	return result;
+}
+
+// little endian, wrapping around at the end of memory
+static inline uint32_t aot_read_four_byte(vm_state *vm, uint16_t address) {
+	return (uint32_t)vm_load_two_byte(vm, address + 2) << 16 | vm_load_two_byte(vm, address);
+}
+
+static inline bool aot_write_four_byte(vm_state *vm, uint16_t address, uint32_t value) {
+	vm_store_two_byte(vm, address, value & 0xffff);
+	vm_store_two_byte(vm, address + 2, value >> 16);
+	return aot_note_write(vm, address, 4);
+}
+
+// runs the instruction at the core's pc in the interpreter, for pcs without
+// a valid block or blocks that don't fit in what is left of the budget
+static vm_run_result aot_interpret_one(vm_state *vm, uint16_t core_index, uint32_t *steps_run) {
+	vm_core const *core = &vm->cores[core_index];
+	uint16_t const pc = core->pc;
+	uint8_t const op = vm_load_byte(vm, pc);
+	uint8_t const b = vm_load_byte(vm, pc + 1);
+
+	// the interpreter doesn't know about our blocks, so work out what the
+	// instruction is going to write ourselves
+	uint16_t address = 0, length = 0;
+	switch (op) {
+	case vm_op_Write_Address_Byte: address = core->registers[b >> 4]; length = 1; break;
+	case vm_op_Write_Address_Two_Byte: address = core->registers[b >> 4]; length = 2; break;
+	case vm_op_Fetch_And_Add_Byte:
+	case vm_op_Compare_And_Swap_Byte:
+	case vm_op_Exchange_Byte:
+		address = core->registers[b & 0x0f];
+		length = 1;
+		break;
+	case vm_op_Fetch_And_Add_Two_Byte:
+	case vm_op_Compare_And_Swap_Two_Byte:
+	case vm_op_Exchange_Two_Byte:
+		address = core->registers[b & 0x0f];
+		length = 2;
+		break;
+	case vm_op_Push:
+	case vm_op_Call_Immediate_Relative:
+	case vm_op_Call_Immediate_Absolute:
+	case vm_op_Call_Relative:
+	case vm_op_Call_Absolute:
+		address = core->registers[15] + 2;
+		length = 2;
+		break;
+	case vm_op_Write_Address_Four_Byte: address = core->registers[b >> 4]; length = 4; break;
+	case vm_op_Memory_Copy:
+	case vm_op_Memory_Fill:
+		address = core->registers[b >> 4];
+		length = core->registers[vm_load_byte(vm, pc + 2) >> 4];
+		break;
+	}
+
+	// vm_run noted the write on the vm side already
+	vm_run_result result = vm_run(vm, core_index, 1, steps_run);
+	if (length && result != vm_run_faulted)
+		aot_drop_written(address, length);
+	return result;
+}
+
+// operands, as in vm_interp.c
+#define R(n) (&regs[n])
+#define SR(n) ((int8_t *)&regs[n])
+#define PAIR(high, low) ((uint32_t)regs[high] << 16 | regs[low])
+
+// continues at a translated block when possible, the dispatcher otherwise
+#define aot_jump(block, target) do { \
+	pc = (target); \
+	if (aot_can_enter(block, max_steps - steps)) goto pc_##target; \
+	goto dispatch; \
+} while (0)
+
+// unretired is how many of the block's instructions come after the one that faulted
+#define aot_fault(at, f, unretired) do { \
+	pc = (at); \
+	steps -= (unretired); \
+	core->fault = (f); \
+	stopped_because = vm_run_faulted; \
+	goto stop; \
+} while (0)
+
+// parks the core when it keeps coming back to target in an idle loop, see
+// vm_idle_park
+#define aot_idle_check(target) do { \
+	if (idle_parking && vm_idle_arrived(&idle, (target), regs) && vm_idle_park(vm, core_index, (target), regs)) { \
+		pc = (target); \
+		stopped_because = vm_run_parked; \
+		goto stop; \
+	} \
+} while (0)
+
+// leaves the block when a write dropped translated code, unretired is how
+// many of the block's instructions won't run
+#define aot_wrote(wrote_code, next_pc, unretired) do { \
+	if (wrote_code) { pc = (next_pc); steps -= (unretired); goto dispatch; } \
+} while (0)
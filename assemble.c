@@ -650,14 +650,26 @@ void apply_patches(void) {
 		exit(1);
 }
 
+// one "<hex offset> <name>" line per label, read by aot to find code that
+// is only reached through indirect branches
+void write_label_map(char const *file_name) {
+	FILE *output = fopen(file_name, "w");
+	if (!output) fatal("Could not open \"%s\" to write the label map", file_name);
+
+	for (size_t i = 0, c = static_buf_count(labels); i < c; ++i)
+		fprintf(output, "%04x " sv_fstr "\n", labels[i].offset, sv_farg(labels[i].name));
+
+	if (fclose(output) != 0) fatal("Could not write the label map");
+}
+
 int main(int argc, char **argv) {
-	if (argc != 2 && argc != 3) {
-		fprintf(stderr, "Usage: assemble <program.asm> [output]\n");
+	if (argc < 2 || argc > 4) {
+		fprintf(stderr, "Usage: assemble <program.asm> [output] [label map]\n");
 		return 1;
 	}
 
 	path = argv[1];
-	char const *out_file_name = argc == 3 ? argv[2] : "out";
+	char const *out_file_name = argc >= 3 ? argv[2] : "out";
 
 	sv contents = read_whole_file(path);
 	assemble(contents);
@@ -675,4 +687,9 @@ int main(int argc, char **argv) {
 	fclose(output);
 
 	printf("Wrote %zu bytes to %s\n", result_len, out_file_name);
+
+	if (argc == 4) {
+		write_label_map(argv[3]);
+		printf("Wrote %zu labels to %s\n", static_buf_count(labels), argv[3]);
+	}
 }
@@ -0,0 +1,37 @@
+; A benchmark of how run scales with host threads, see bench.sh. Every core
+; does the same amount of work on memory of its own, the last one to finish
+; turns the machine off.
+%power-port( #ff )
+	core r1
+	; memory of our own at (#40 + core) << 8
+	lib r2 #40
+	add r9 r3 r1 r2
+	sib r3 #00
+
+	lib r2 8
+@outer:
+	lib r4 #ff sib r4 #ff
+@inner:
+	wab r3 r4
+	rab r5 r3
+	dec r9 r4 1
+	snz r4
+	bia abs@next
+	bia abs@inner
+@next:
+	dec r9 r2 1
+	snz r2
+	bia abs@done
+	bia abs@outer
+
+@done:
+	lib r6 #10 sib r6 #00 ; how many cores are done
+	lib r7 1
+	fetchadd r8 r6 r7
+	ncores r10
+	dec r9 r10 1
+	eq r11 r12 r8 r10
+	sz r11
+	portw r0 %power-port
+@finished:
+	bia abs@finished
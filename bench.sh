@@ -0,0 +1,38 @@
+#!/usr/bin/env sh
+
+# Runs bench.asm with one core per host thread for each thread count given
+# (1 to 64 by default) and prints how long it ran. Every core does the
+# same work, so the time should stay flat for as long as the host has
+# hardware threads to spare. Extra flags for run can go in RUN_FLAGS. To
+# see what keeping cores on cache lines of their own buys, rebuild run with
+# them packed (CFLAGS=-DVM_CACHE_LINE=8 sh make-tool.sh run) and compare.
+#
+# Then it runs uneven.asm, where some cores have much more to do than
+# others, on fewer threads than cores, so threads that run out of work
+# steal cores from the others. run -s counts the steals, and the guest
+# faults (failing the script) if any core was run twice.
+#
+# Last it runs stores.asm, a loop that writes every third instruction, on
+# one core with and without idle parking (-i), in the interpreter and with
+# -j. Parking is on by default and looks at every write, which shouldn't
+# make code that never parks any slower.
+
+set -e
+
+./assemble bench.asm bench.bin > /dev/null
+./assemble uneven.asm uneven.bin > /dev/null
+./assemble stores.asm stores.bin > /dev/null
+
+for threads in ${*:-1 2 4 8 16 32 64}; do
+	# run -s times itself, leaving out starting up and loading
+	stats=$(./run $RUN_FLAGS -s -c "$threads" -t "$threads" bench.bin 2>&1) || { printf '%s\n' "$stats"; exit 1; }
+	echo "$threads threads: $(printf '%s\n' "$stats" | sed -n 's/^Ran for \([0-9]*\) ms$/\1/p') ms"
+done
+
+stats=$(./run $RUN_FLAGS -s -c 16 -t 4 uneven.bin 2>&1) || { printf '%s\n' "$stats"; exit 1; }
+printf '%s\n' "$stats" | grep 'stolen'
+
+for flags in "" "-i" "-j" "-j -i"; do
+	stats=$(./run $RUN_FLAGS $flags -s stores.bin 2>&1) || { printf '%s\n' "$stats"; exit 1; }
+	echo "stores ${flags:-(default)}: $(printf '%s\n' "$stats" | sed -n 's/^Ran for \([0-9]*\) ms$/\1/p') ms"
+done
@@ -1,41 +1,538 @@
+// writev, poll, mmap and IOV_MAX
+#define _XOPEN_SOURCE 700
+
 #include "common_ports.h"
+#include <limits.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <threads.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
-uint16_t common_port_read(void *v_state, uint8_t port_number) {
-	common_port_state *state = v_state;
+// what reading a port without an input device gives
+static uint16_t nothing_read(void *state, uint8_t port_number) {
+	(void)state;
+	(void)port_number;
+	return 0xffff;
+}
+
+static uint16_t terminal_input_read(void *state, uint8_t port_number) {
 	(void)state;
-	switch ((common_port)port_number) {
-	case common_port_terminal_input:
-		return fgetc(stdin);
+	(void)port_number;
+	return fgetc(stdin);
+}
 
-	case common_port_terminal_output:
-	case common_port_shut_down:
-		break;
+static void terminal_output_write(void *state, uint8_t port_number, uint16_t data) {
+	(void)state;
+	(void)port_number;
+	fputc(data & 0x7f, stdout);
+}
+
+static void shut_down_write(void *v_state, uint8_t port_number, uint16_t data) {
+	common_port_state *state = v_state;
+	(void)port_number;
+	(void)data;
+	state->wrote_to_shut_down = true;
+}
+
+void vm_install_common_ports(vm_state *vm, common_port_state *state) {
+	state->wrote_to_shut_down = false;
+	state->output = NULL;
+	state->input = NULL;
+	state->block_device = NULL;
+	for (uint16_t port = 0; port < 256; ++port)
+		vm_register_port(vm, port, (vm_port){ .context = state, .read = nothing_read });
+
+	vm_register_port(vm, common_port_terminal_input, (vm_port){ .context = state, .read = terminal_input_read });
+	vm_register_port(vm, common_port_terminal_output, (vm_port){ .context = state, .read = nothing_read, .write = terminal_output_write });
+	vm_register_port(vm, common_port_shut_down, (vm_port){ .context = state, .read = nothing_read, .write = shut_down_write, .stop = true });
+}
+
+// Buffered terminal output
+//
+// Every host thread that writes to the terminal gets its own ring of bytes,
+// which only it appends to, so writing a character takes no locks. A
+// background thread drains all the rings into one writev every
+// TERMINAL_FLUSH_INTERVAL_NS, or sooner when a ring fills past half way.
+//
+// Ordering: the bytes of one host thread come out in the order they were
+// written. Between threads, output is interleaved a whole line at a time,
+// except for lines longer than half a ring, and for a partial line that
+// its thread hasn't added to for a whole interval (e.g. a prompt), which
+// are written as they are.
+
+#define TERMINAL_RING_SIZE (1u << 16)
+#define TERMINAL_FLUSH_INTERVAL_NS 5000000
+
+typedef struct terminal_ring {
+	struct terminal_ring *next;
+	_Atomic uint32_t head; // only advanced by the thread owning the ring
+	_Atomic uint32_t tail; // only advanced with the drain lock held
+	uint32_t head_at_last_drain;
+	char bytes[TERMINAL_RING_SIZE];
+} terminal_ring;
+
+struct common_terminal_output {
+	uint32_t id;
+	int fd;
+	_Atomic(terminal_ring *) rings;
+	mtx_t drain_lock;
+
+	mtx_t wake_lock;
+	cnd_t wake;
+	_Atomic bool stopping;
+	thrd_t flusher;
+};
+
+// outputs are told apart by id rather than address, as a new one may be
+// allocated where a stopped one was
+static _Atomic uint32_t next_output_id = 1;
+
+static _Thread_local struct {
+	uint32_t output_id;
+	terminal_ring *ring;
+} thread_ring;
+
+static terminal_ring *ring_for_this_thread(common_terminal_output *output) {
+	if (thread_ring.output_id == output->id)
+		return thread_ring.ring;
+
+	terminal_ring *ring = malloc(sizeof *ring);
+	if (!ring) return NULL;
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	ring->head_at_last_drain = 0;
+
+	ring->next = atomic_load_explicit(&output->rings, memory_order_relaxed);
+	while (!atomic_compare_exchange_weak_explicit(&output->rings, &ring->next, ring, memory_order_release, memory_order_relaxed))
+		;
+
+	thread_ring.output_id = output->id;
+	thread_ring.ring = ring;
+	return ring;
+}
+
+static void write_all(int fd, struct iovec *iov, int count) {
+	while (count > 0) {
+		ssize_t written = writev(fd, iov, count < IOV_MAX ? count : IOV_MAX);
+		if (written < 0) {
+			if (errno == EINTR) continue;
+			return; // nowhere to report it, drop the output
+		}
+
+		for (; count > 0 && (size_t)written >= iov->iov_len; ++iov, --count)
+			written -= iov->iov_len;
+		if (count > 0) {
+			iov->iov_base = (char *)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
 	}
+}
+
+// writes out what the rings hold, everything when all is set, otherwise as
+// described above
+static void drain(common_terminal_output *output, bool all) {
+	mtx_lock(&output->drain_lock);
+
+	enum { batch = 64 };
+	struct iovec iov[2 * batch];
+	terminal_ring *rings[batch];
+	uint32_t new_tails[batch];
+	int iov_count = 0, ring_count = 0;
+
+	for (terminal_ring *ring = atomic_load_explicit(&output->rings, memory_order_acquire); ring; ring = ring->next) {
+		uint32_t const head = atomic_load_explicit(&ring->head, memory_order_acquire);
+		uint32_t const tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+		uint32_t end = head;
+
+		if (!all && head - tail < TERMINAL_RING_SIZE / 2 && head != ring->head_at_last_drain) {
+			// only whole lines while the thread is still writing
+			while (end != tail && ring->bytes[(end - 1) % TERMINAL_RING_SIZE] != '\n')
+				--end;
+		}
+		ring->head_at_last_drain = head;
+		if (end == tail) continue;
+
+		uint32_t const first = tail % TERMINAL_RING_SIZE, length = end - tail;
+		uint32_t const until_wrap = TERMINAL_RING_SIZE - first;
+		iov[iov_count++] = (struct iovec){ &ring->bytes[first], length < until_wrap ? length : until_wrap };
+		if (length > until_wrap)
+			iov[iov_count++] = (struct iovec){ &ring->bytes[0], length - until_wrap };
+		rings[ring_count] = ring;
+		new_tails[ring_count++] = end;
+
+		if (ring_count == batch) {
+			write_all(output->fd, iov, iov_count);
+			for (int i = 0; i < ring_count; ++i)
+				atomic_store_explicit(&rings[i]->tail, new_tails[i], memory_order_release);
+			iov_count = ring_count = 0;
+		}
+	}
+	if (ring_count > 0) {
+		write_all(output->fd, iov, iov_count);
+		for (int i = 0; i < ring_count; ++i)
+			atomic_store_explicit(&rings[i]->tail, new_tails[i], memory_order_release);
+	}
+
+	mtx_unlock(&output->drain_lock);
+}
+
+static int flusher(void *v_output) {
+	common_terminal_output *output = v_output;
+
+	while (!atomic_load_explicit(&output->stopping, memory_order_acquire)) {
+		struct timespec until;
+		timespec_get(&until, TIME_UTC);
+		until.tv_nsec += TERMINAL_FLUSH_INTERVAL_NS;
+		if (until.tv_nsec >= 1000000000) {
+			until.tv_sec += 1;
+			until.tv_nsec -= 1000000000;
+		}
+
+		mtx_lock(&output->wake_lock);
+		cnd_timedwait(&output->wake, &output->wake_lock, &until);
+		mtx_unlock(&output->wake_lock);
+
+		drain(output, false);
+	}
+
+	return 0;
+}
+
+static void buffered_output_write(void *v_state, uint8_t port_number, uint16_t data) {
+	common_port_state *state = v_state;
+	common_terminal_output *output = state->output;
+	(void)port_number;
+
+	terminal_ring *ring = ring_for_this_thread(output);
+	if (!ring) {
+		// out of memory, fall back to writing one byte at a time
+		char c = data & 0x7f;
+		write_all(output->fd, &(struct iovec){ &c, 1 }, 1);
+		return;
+	}
+
+	uint32_t const head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == TERMINAL_RING_SIZE)
+		drain(output, true);
+
+	ring->bytes[head % TERMINAL_RING_SIZE] = data & 0x7f;
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+	if (head + 1 - atomic_load_explicit(&ring->tail, memory_order_relaxed) == TERMINAL_RING_SIZE / 2)
+		cnd_signal(&output->wake);
+}
+
+bool common_ports_buffer_output(vm_state *vm, common_port_state *state) {
+	common_terminal_output *output = malloc(sizeof *output);
+	if (!output) return false;
+
+	output->id = atomic_fetch_add_explicit(&next_output_id, 1, memory_order_relaxed);
+	output->fd = fileno(stdout);
+	atomic_init(&output->rings, NULL);
+	atomic_init(&output->stopping, false);
+	if (mtx_init(&output->drain_lock, mtx_plain) != thrd_success) goto fail_drain_lock;
+	if (mtx_init(&output->wake_lock, mtx_plain) != thrd_success) goto fail_wake_lock;
+	if (cnd_init(&output->wake) != thrd_success) goto fail_wake;
+	if (thrd_create(&output->flusher, flusher, output) != thrd_success) goto fail_thread;
+
+	// whatever went through stdio so far has to come out first
+	fflush(stdout);
+
+	state->output = output;
+	vm_register_port(vm, common_port_terminal_output, (vm_port){ .context = state, .read = nothing_read, .write = buffered_output_write });
+	return true;
+
+fail_thread: cnd_destroy(&output->wake);
+fail_wake: mtx_destroy(&output->wake_lock);
+fail_wake_lock: mtx_destroy(&output->drain_lock);
+fail_drain_lock: free(output);
+	return false;
+}
 
+void common_ports_flush_output(common_port_state *state) {
+	if (state->output)
+		drain(state->output, true);
+}
+
+void common_ports_stop_output(vm_state *vm, common_port_state *state) {
+	common_terminal_output *output = state->output;
+	if (!output) return;
+
+	vm_register_port(vm, common_port_terminal_output, (vm_port){ .context = state, .read = nothing_read, .write = terminal_output_write });
+	atomic_store_explicit(&output->stopping, true, memory_order_release);
+	cnd_signal(&output->wake);
+	thrd_join(output->flusher, NULL);
+	drain(output, true);
+
+	for (terminal_ring *ring = atomic_load_explicit(&output->rings, memory_order_acquire), *next; ring; ring = next) {
+		next = ring->next;
+		free(ring);
+	}
+	cnd_destroy(&output->wake);
+	mtx_destroy(&output->wake_lock);
+	mtx_destroy(&output->drain_lock);
+	free(output);
+	state->output = NULL;
+}
+
+// Non-blocking terminal input
+//
+// A background thread reads stdin into a ring as soon as anything arrives.
+// Cores take bytes out of the ring without ever waiting for the terminal:
+// when it is empty the data port reads as common_terminal_no_data, or
+// common_terminal_end_of_input once stdin has been closed. The reader waits
+// on stdin and a pipe together, stopping writes to the pipe.
+
+#define TERMINAL_INPUT_RING_SIZE 4096
+
+struct common_terminal_input {
+	int fd;
+	int wake[2]; // from pipe, a byte in it stops the reader
+	_Atomic uint32_t head; // only advanced by the reader
+	_Atomic uint32_t tail; // advanced by whichever core takes a byte
+	_Atomic bool at_end, stopping;
+	thrd_t reader;
+	uint8_t bytes[TERMINAL_INPUT_RING_SIZE];
+};
+
+static int reader(void *v_input) {
+	common_terminal_input *input = v_input;
+
+	while (!atomic_load_explicit(&input->stopping, memory_order_acquire)) {
+		uint32_t const head = atomic_load_explicit(&input->head, memory_order_relaxed);
+		uint32_t const space = TERMINAL_INPUT_RING_SIZE - (head - atomic_load_explicit(&input->tail, memory_order_acquire));
+		if (space == 0) {
+			// nobody is reading, no point in taking more from the terminal yet
+			thrd_sleep(&(struct timespec){ .tv_nsec = 1000000 }, NULL);
+			continue;
+		}
+
+		struct pollfd poll_fds[2] = {
+			{ .fd = input->fd, .events = POLLIN },
+			{ .fd = input->wake[0], .events = POLLIN },
+		};
+		if (poll(poll_fds, 2, -1) <= 0)
+			continue;
+		if (poll_fds[1].revents)
+			break;
+
+		uint32_t const first = head % TERMINAL_INPUT_RING_SIZE;
+		uint32_t const until_wrap = TERMINAL_INPUT_RING_SIZE - first;
+		ssize_t result = read(input->fd, &input->bytes[first], space < until_wrap ? space : until_wrap);
+		if (result < 0 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		if (result <= 0)
+			break;
+
+		atomic_store_explicit(&input->head, head + result, memory_order_release);
+	}
+
+	atomic_store_explicit(&input->at_end, true, memory_order_release);
+	return 0;
+}
+
+static uint16_t nonblocking_input_read(void *v_state, uint8_t port_number) {
+	common_port_state *state = v_state;
+	common_terminal_input *input = state->input;
+	(void)port_number;
+
+	uint32_t tail = atomic_load_explicit(&input->tail, memory_order_relaxed);
+	for (;;) {
+		if (tail == atomic_load_explicit(&input->head, memory_order_acquire)) {
+			if (!atomic_load_explicit(&input->at_end, memory_order_acquire))
+				return common_terminal_no_data;
+			// the reader may have added its last bytes just before stopping
+			if (tail == atomic_load_explicit(&input->head, memory_order_acquire))
+				return common_terminal_end_of_input;
+		}
+
+		// the reader never overwrites a byte before tail moves past it, so
+		// if the exchange succeeds the byte we read was still the right one
+		uint8_t byte = input->bytes[tail % TERMINAL_INPUT_RING_SIZE];
+		if (atomic_compare_exchange_weak_explicit(&input->tail, &tail, tail + 1, memory_order_release, memory_order_relaxed))
+			return byte;
+	}
+}
+
+static uint16_t input_status_read(void *v_state, uint8_t port_number) {
+	common_port_state *state = v_state;
+	common_terminal_input *input = state->input;
+	(void)port_number;
+
+	uint32_t const tail = atomic_load_explicit(&input->tail, memory_order_relaxed);
+	return atomic_load_explicit(&input->head, memory_order_acquire) - tail;
+}
+
+bool common_ports_nonblocking_input(vm_state *vm, common_port_state *state) {
+	common_terminal_input *input = malloc(sizeof *input);
+	if (!input) return false;
+
+	input->fd = fileno(stdin);
+	atomic_init(&input->head, 0);
+	atomic_init(&input->tail, 0);
+	atomic_init(&input->at_end, false);
+	atomic_init(&input->stopping, false);
+	if (pipe(input->wake) != 0) {
+		free(input);
+		return false;
+	}
+	if (thrd_create(&input->reader, reader, input) != thrd_success) {
+		close(input->wake[0]);
+		close(input->wake[1]);
+		free(input);
+		return false;
+	}
+
+	state->input = input;
+	vm_register_port(vm, common_port_terminal_input, (vm_port){ .context = state, .read = nonblocking_input_read });
+	vm_register_port(vm, common_port_terminal_input_status, (vm_port){ .context = state, .read = input_status_read });
+	return true;
+}
+
+void common_ports_stop_input(vm_state *vm, common_port_state *state) {
+	common_terminal_input *input = state->input;
+	if (!input) return;
+
+	vm_register_port(vm, common_port_terminal_input, (vm_port){ .context = state, .read = terminal_input_read });
+	vm_register_port(vm, common_port_terminal_input_status, (vm_port){ .context = state, .read = nothing_read });
+
+	atomic_store_explicit(&input->stopping, true, memory_order_release);
+	// wakes the reader out of poll, nothing else writes to the pipe so
+	// there is room for the byte
+	while (write(input->wake[1], "", 1) < 0 && errno == EINTR);
+	thrd_join(input->reader, NULL);
+	close(input->wake[0]);
+	close(input->wake[1]);
+	free(input);
+	state->input = NULL;
+}
+
+// Block device
+//
+// The host file is mapped shared, so blocks written by the guest end up in
+// the file without any further copying. The device's registers are shared
+// by every core, cores that use it at the same time need to take turns
+// programming it.
+
+struct common_block_device {
+	vm_state *vm;
+	int fd;
+	uint8_t *blocks;
+	size_t bytes; // mapped, a multiple of COMMON_BLOCK_SIZE
+	uint32_t count;
+	_Atomic uint16_t number, address, status;
+};
+
+static uint16_t block_register_read(void *v_state, uint8_t port_number) {
+	common_port_state *state = v_state;
+	common_block_device *device = state->block_device;
+	switch (port_number) {
+	case common_port_block_number: return device->number;
+	case common_port_block_address: return device->address;
+	case common_port_block_command: return device->status;
+	case common_port_block_count: return device->count > 0xffff ? 0xffff : device->count;
+	}
 	return 0xffff;
 }
 
-void common_port_write(void *v_state, uint8_t port_number, uint16_t data) {
+static void block_register_write(void *v_state, uint8_t port_number, uint16_t data) {
 	common_port_state *state = v_state;
-	switch ((common_port)port_number) {
-	case common_port_terminal_input:
-		break;
-	case common_port_terminal_output:
-		fputc(data & 0x7f, stdout);
+	common_block_device *device = state->block_device;
+	switch (port_number) {
+	case common_port_block_number: device->number = data; break;
+	case common_port_block_address: device->address = data; break;
+	}
+}
+
+static void block_command_write(void *v_state, uint8_t port_number, uint16_t data) {
+	common_port_state *state = v_state;
+	common_block_device *device = state->block_device;
+	(void)port_number;
+
+	uint16_t const number = device->number;
+	uint16_t const address = device->address;
+	if (number >= device->count || (size_t)address + COMMON_BLOCK_SIZE > VM_MEMORY_SIZE) {
+		device->status = common_block_out_of_range;
+		return;
+	}
+
+	uint8_t *block = &device->blocks[(size_t)number * COMMON_BLOCK_SIZE];
+	switch (data) {
+	case common_block_read:
+		vm_store_bytes(device->vm, address, block, COMMON_BLOCK_SIZE);
+		vm_invalidate_decoded(device->vm, address, COMMON_BLOCK_SIZE);
 		break;
-	case common_port_shut_down:
-		state->wrote_to_shut_down = true;
+	case common_block_write:
+		vm_load_bytes(device->vm, address, block, COMMON_BLOCK_SIZE);
 		break;
+	default:
+		device->status = common_block_bad_command;
+		return;
 	}
+	device->status = common_block_ok;
 }
 
-void vm_install_common_ports(vm_state *vm, common_port_state *state) {
-	state->wrote_to_shut_down = false;
-	vm->ports = (vm_ports){
-		.context = state,
-		.port_read = common_port_read,
-		.port_write = common_port_write,
-	};
+bool common_ports_attach_block_device(vm_state *vm, common_port_state *state, char const *file_name) {
+	int fd = open(file_name, O_RDWR);
+	if (fd < 0) return false;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < COMMON_BLOCK_SIZE) {
+		close(fd);
+		return false;
+	}
+
+	// a partial block at the end of the file is left alone
+	size_t count = st.st_size / COMMON_BLOCK_SIZE;
+	if (count > 0x10000) count = 0x10000;
+	size_t const bytes = count * COMMON_BLOCK_SIZE;
+
+	void *blocks = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	common_block_device *device = malloc(sizeof *device);
+	if (blocks == MAP_FAILED || !device) {
+		if (blocks != MAP_FAILED) munmap(blocks, bytes);
+		free(device);
+		close(fd);
+		return false;
+	}
+
+	device->vm = vm;
+	device->fd = fd;
+	device->blocks = blocks;
+	device->bytes = bytes;
+	device->count = count;
+	atomic_init(&device->number, 0);
+	atomic_init(&device->address, 0);
+	atomic_init(&device->status, common_block_ok);
+	state->block_device = device;
+
+	vm_port const registers = { .context = state, .read = block_register_read, .write = block_register_write };
+	vm_register_port(vm, common_port_block_number, registers);
+	vm_register_port(vm, common_port_block_address, registers);
+	vm_register_port(vm, common_port_block_count, registers);
+	vm_register_port(vm, common_port_block_command, (vm_port){ .context = state, .read = block_register_read, .write = block_command_write });
+	return true;
+}
+
+void common_ports_detach_block_device(vm_state *vm, common_port_state *state) {
+	common_block_device *device = state->block_device;
+	if (!device) return;
+
+	for (uint8_t port = common_port_block_number; port <= common_port_block_count; ++port)
+		vm_register_port(vm, port, (vm_port){ .context = state, .read = nothing_read });
+
+	msync(device->blocks, device->bytes, MS_SYNC);
+	munmap(device->blocks, device->bytes);
+	close(device->fd);
+	free(device);
+	state->block_device = NULL;
 }
@@ -9,17 +9,70 @@
 typedef enum common_port {
 	common_port_terminal_input    = 150,
 	common_port_terminal_output   = 151,
+	common_port_terminal_input_status = 152, // bytes ready to be read, with non-blocking input
+
+	// with a block device attached
+	common_port_block_number  = 160,
+	common_port_block_address = 161, // where in guest memory the block goes to or comes from
+	common_port_block_command = 162, // write a common_block_command, read the common_block_status of the last one
+	common_port_block_count   = 163, // read only
 
 	common_port_shut_down = 255,
 } common_port;
 
-uint16_t common_port_read(void *, uint8_t port_number);
-void common_port_write(void *, uint8_t port_number, uint16_t data);
+// what the terminal input port reads as besides bytes
+enum {
+	common_terminal_no_data = 0xfffe,      // nothing to read yet, only with non-blocking input
+	common_terminal_end_of_input = 0xffff,
+};
+
+#define COMMON_BLOCK_SIZE 512
+
+typedef enum common_block_command {
+	common_block_read = 0,  // file to guest memory
+	common_block_write = 1, // guest memory to file
+} common_block_command;
+
+typedef enum common_block_status {
+	common_block_ok = 0,
+	common_block_out_of_range = 1, // no such block, or it doesn't fit at the address
+	common_block_bad_command = 2,
+} common_block_status;
+
+typedef struct common_terminal_output common_terminal_output;
+typedef struct common_terminal_input common_terminal_input;
+typedef struct common_block_device common_block_device;
 
 typedef struct common_port_state {
 	_Atomic bool wrote_to_shut_down;
+	common_terminal_output *output; // NULL while terminal output is unbuffered
+	common_terminal_input *input; // NULL while terminal input blocks
+	common_block_device *block_device; // NULL if none is attached
 } common_port_state;
 
+// registers a handler for each of the common ports, terminal output goes
+// straight to stdout
 void vm_install_common_ports(vm_state *, common_port_state *);
 
+// Switches terminal output to per host thread buffers written out by a
+// background thread (see common_ports.c for the ordering guarantees).
+// Returns false if the thread could not be started. Faults and shutting
+// down should flush it, so that nothing the guest wrote is lost.
+bool common_ports_buffer_output(vm_state *, common_port_state *);
+void common_ports_flush_output(common_port_state *);
+void common_ports_stop_output(vm_state *, common_port_state *); // flushes and goes back to unbuffered
+
+// Has a background thread read stdin, so that reading the terminal input
+// port never blocks (see common_ports.c). Returns false if the thread could
+// not be started. Stopping goes back to blocking input.
+bool common_ports_nonblocking_input(vm_state *, common_port_state *);
+void common_ports_stop_input(vm_state *, common_port_state *);
+
+// Maps a host file as a disk of COMMON_BLOCK_SIZE byte blocks. A guest sets
+// the block number and address ports, then one write to the command port
+// copies the whole block. Returns false if the file could not be opened or
+// mapped, or is smaller than a block.
+bool common_ports_attach_block_device(vm_state *, common_port_state *, char const *file_name);
+void common_ports_detach_block_device(vm_state *, common_port_state *);
+
 #endif // COMMON_PORTS_H
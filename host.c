@@ -0,0 +1,251 @@
+// sched_setaffinity, memfd_create and syscall
+#define _GNU_SOURCE
+
+#include "host.h"
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/membarrier.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+bool host_parse_cpu_list(char const *list, host_cpu_list *out) {
+	out->count = 0;
+	while (*list) {
+		char *end;
+		long first = strtol(list, &end, 10);
+		if (end == list || first < 0) return false;
+		long last = first;
+		if (*end == '-') {
+			char const *from = end + 1;
+			last = strtol(from, &end, 10);
+			if (end == from || last < first) return false;
+		}
+		if (last >= HOST_MAX_CPUS) return false;
+		for (long cpu = first; cpu <= last; ++cpu) {
+			if (out->count == HOST_MAX_CPUS) return false;
+			out->cpus[out->count++] = cpu;
+		}
+
+		if (*end == ',') ++end;
+		// /sys ends its lists with a newline
+		else if (*end == '\n') break;
+		else if (*end) return false;
+		list = end;
+	}
+	return out->count > 0;
+}
+
+bool host_node_cpus(int node, host_cpu_list *out) {
+	char path[64];
+	snprintf(path, sizeof path, "/sys/devices/system/node/node%d/cpulist", node);
+	FILE *file = fopen(path, "r");
+	if (!file) return false;
+
+	char list[4096];
+	bool ok = fgets(list, sizeof list, file) && host_parse_cpu_list(list, out);
+	fclose(file);
+	return ok;
+}
+
+void *host_alloc_pages(size_t size) {
+#ifdef __linux__
+	size_t const page = sysconf(_SC_PAGESIZE);
+#else
+	size_t const page = 4096; // nothing gets placed here, only alignment depends on it
+#endif
+	size = (size + page - 1) / page * page;
+	void *pages = aligned_alloc(page, size);
+	if (pages) memset(pages, 0, size);
+	return pages;
+}
+
+#ifdef __linux__
+
+bool host_pin_thread(uint16_t cpu) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return sched_setaffinity(0, sizeof set, &set) == 0;
+}
+
+// from linux/mempolicy.h, which libc doesn't wrap without libnuma
+enum {
+	host_mpol_preferred = 1,
+	host_mpol_local = 4,
+	host_mpol_mf_move = 1 << 1,
+};
+
+static bool host_mbind(void *address, size_t size, int mode, unsigned long const *nodes, unsigned long max_node) {
+	// mbind wants whole pages
+	uintptr_t const page = sysconf(_SC_PAGESIZE);
+	uintptr_t const start = (uintptr_t)address & ~(page - 1);
+	uintptr_t const end = ((uintptr_t)address + size + page - 1) & ~(page - 1);
+	return syscall(SYS_mbind, start, end - start, mode, nodes, max_node, host_mpol_mf_move) == 0;
+}
+
+bool host_place_on_node(void *address, size_t size, int node) {
+	enum { bits = 8 * sizeof(unsigned long) };
+	unsigned long nodes[HOST_MAX_CPUS / bits] = { 0 };
+	if (node < 0 || node >= HOST_MAX_CPUS) return false;
+	nodes[node / bits] = 1ul << (node % bits);
+	return host_mbind(address, size, host_mpol_preferred, nodes, HOST_MAX_CPUS);
+}
+
+bool host_place_near_thread(void *address, size_t size) {
+	return host_mbind(address, size, host_mpol_local, NULL, 0);
+}
+
+bool host_fence_other_threads(void) {
+	// the process has to register before its first expedited barrier
+	static _Atomic int registered; // 0 not yet, 1 registered, -1 unavailable
+	int state = atomic_load_explicit(&registered, memory_order_acquire);
+	if (state == 0) {
+		state = syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) == 0 ? 1 : -1;
+		atomic_store_explicit(&registered, state, memory_order_release);
+	}
+	return state > 0 && syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0) == 0;
+}
+
+// Reserves size bytes and a page after them, then maps the first page of a
+// new file over both the first page and the one after the end. The rest is
+// left to the caller, NULL on failure.
+static uint8_t *host_map_mirrored(size_t size, int *first_page) {
+	size_t const page = sysconf(_SC_PAGESIZE);
+	uint8_t *memory = mmap(NULL, size + page, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED) return NULL;
+
+	*first_page = memfd_create("lil-vm memory", MFD_CLOEXEC);
+	if (*first_page < 0) goto fail;
+	if (ftruncate(*first_page, page) != 0
+		|| mmap(memory, page, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, *first_page, 0) == MAP_FAILED
+		|| mmap(memory + size, page, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, *first_page, 0) == MAP_FAILED) {
+		close(*first_page);
+		goto fail;
+	}
+	return memory;
+
+fail:
+	munmap(memory, size + page);
+	return NULL;
+}
+
+void *host_map_memory(size_t size) {
+	size_t const page = sysconf(_SC_PAGESIZE);
+	int first_page;
+	uint8_t *memory = host_map_mirrored(size, &first_page);
+	if (!memory) return NULL;
+	// the mappings keep the file
+	close(first_page);
+
+	// with large pages (64KiB on some arm64 and ppc64 kernels) the mirrored
+	// page may be all there is
+	if (size > page && mmap(memory + page, size - page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+		host_unmap_memory(memory, size);
+		return NULL;
+	}
+	return memory;
+}
+
+void host_unmap_memory(void *memory, size_t size) {
+	munmap(memory, size + sysconf(_SC_PAGESIZE));
+}
+
+int host_image_create(void const *memory, size_t size) {
+	int image = memfd_create("lil-vm image", MFD_CLOEXEC);
+	if (image < 0) return -1;
+	if (ftruncate(image, size) != 0) goto fail;
+
+	// pages of the file that stay all zero are never allocated
+	uint8_t *file = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, image, 0);
+	if (file == MAP_FAILED) goto fail;
+	static uint8_t const zeroes[4096];
+	for (size_t at = 0; at < size; at += sizeof zeroes) {
+		size_t const length = size - at < sizeof zeroes ? size - at : sizeof zeroes;
+		if (memcmp((uint8_t const *)memory + at, zeroes, length) != 0)
+			memcpy(file + at, (uint8_t const *)memory + at, length);
+	}
+	munmap(file, size);
+	return image;
+
+fail:
+	close(image);
+	return -1;
+}
+
+void *host_image_fork(int image, size_t size) {
+	size_t const page = sysconf(_SC_PAGESIZE);
+	int first_page;
+	uint8_t *memory = host_map_mirrored(size, &first_page);
+	if (!memory) return NULL;
+	close(first_page);
+
+	// A private mapping can't be mirrored, so the first page is a copy of
+	// the image's and only the others are shared with it.
+	size_t const first = size < page ? size : page;
+	if (pread(image, memory, first, 0) != (ssize_t)first
+		|| (size > page && mmap(memory + page, size - page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, image, page) == MAP_FAILED)) {
+		host_unmap_memory(memory, size);
+		return NULL;
+	}
+	return memory;
+}
+
+void host_image_destroy(int image) {
+	close(image);
+}
+
+host_map_result host_map_file(char const *path, void *memory, size_t limit, size_t *length) {
+	int file = open(path, O_RDONLY | O_CLOEXEC);
+	if (file < 0) return host_map_cant_open;
+
+	host_map_result result = host_map_failed;
+	struct stat status;
+	if (fstat(file, &status) != 0) goto done;
+	result = host_map_unavailable;
+	if (!S_ISREG(status.st_mode)) goto done;
+	result = host_map_too_large;
+	if ((uintmax_t)status.st_size > limit) goto done;
+
+	// The first page is read rather than mapped so that it stays mirrored.
+	// The end of the last page past the end of the file reads as zero.
+	size_t const page = sysconf(_SC_PAGESIZE);
+	size_t const first = (size_t)status.st_size < page ? (size_t)status.st_size : page;
+	result = host_map_failed;
+	if (pread(file, memory, first, 0) != (ssize_t)first)
+		goto done;
+	if ((size_t)status.st_size > page && mmap((uint8_t *)memory + page, status.st_size - page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, file, page) == MAP_FAILED)
+		goto done;
+	*length = status.st_size;
+	result = host_map_ok;
+
+done:
+	// the mapping keeps the file
+	close(file);
+	return result;
+}
+
+#else
+
+bool host_pin_thread(uint16_t cpu) { (void)cpu; return false; }
+bool host_place_on_node(void *address, size_t size, int node) { (void)address; (void)size; (void)node; return false; }
+bool host_place_near_thread(void *address, size_t size) { (void)address; (void)size; return false; }
+bool host_fence_other_threads(void) { return false; }
+
+// there is no mirror here, VM_MEMORY_MIRROR is 0 and the vm wraps around itself
+void *host_map_memory(size_t size) { return calloc(size, 1); }
+void host_unmap_memory(void *memory, size_t size) { (void)size; free(memory); }
+int host_image_create(void const *memory, size_t size) { (void)memory; (void)size; return -1; }
+void *host_image_fork(int image, size_t size) { (void)image; (void)size; return NULL; }
+void host_image_destroy(int image) { (void)image; }
+host_map_result host_map_file(char const *path, void *memory, size_t limit, size_t *length) { (void)path; (void)memory; (void)limit; (void)length; return host_map_unavailable; }
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef HOST_H
+#define HOST_H
+
+// Where run puts its threads and memory, and how machines get their memory.
+// These use Linux interfaces (sched_setaffinity, mbind, memfd and /sys) and
+// return false on other hosts, or when the CPU or NUMA node asked for isn't
+// there, leaving placement to the OS.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define HOST_MAX_CPUS 1024
+
+typedef struct host_cpu_list {
+	uint16_t count;
+	uint16_t cpus[HOST_MAX_CPUS];
+} host_cpu_list;
+
+// parses a list like "0-3,8,10-11" as /sys and taskset write them
+bool host_parse_cpu_list(char const *, host_cpu_list *);
+// the CPUs of a NUMA node
+bool host_node_cpus(int node, host_cpu_list *);
+
+// pins the calling thread to one CPU
+bool host_pin_thread(uint16_t cpu);
+
+// Asks for the pages covering [address, address + size) to live on a NUMA
+// node, moving those that were already touched. The near_thread version
+// uses the node of the CPU the calling thread runs on.
+bool host_place_on_node(void *address, size_t size, int node);
+bool host_place_near_thread(void *address, size_t size);
+
+// Runs a full memory barrier on every other running thread of the process
+// (membarrier), so the hot side of a handshake only needs to keep the
+// compiler from reordering. Returns false where that isn't available.
+bool host_fence_other_threads(void);
+// Zeroed memory in whole pages of its own, for anything that gets placed on
+// a node, so placing it doesn't move whatever else would share its pages.
+// Freed with free. NULL if out of memory.
+void *host_alloc_pages(size_t size);
+
+// Zeroed memory for a machine, size bytes (a multiple of the page size)
+// followed by a mirror of the first page, so accesses that run past the end
+// wrap around on their own. Page aligned, pages are only allocated once
+// they are touched. Other hosts get plain zeroed memory without the mirror,
+// see VM_MEMORY_MIRROR. NULL if out of memory.
+void *host_map_memory(size_t size);
+// for memory from host_map_memory and host_image_fork
+void host_unmap_memory(void *, size_t size);
+
+// An image keeps a copy of a machine's memory in an anonymous file that any
+// number of machines map copy-on-write with host_image_fork, so pages none
+// of them write are stored once and a fork only costs the pages it
+// touches. Returns -1 on failure and on other hosts.
+int host_image_create(void const *memory, size_t size);
+// Memory laid out like host_map_memory's that holds the image. Every page
+// but the first is shared with the image, the first is copied so that it
+// can be mirrored. NULL on failure and on other hosts.
+void *host_image_fork(int image, size_t size);
+// forks keep working after their image is destroyed
+void host_image_destroy(int image);
+
+typedef enum host_map_result {
+	host_map_ok,
+	host_map_unavailable, // not a regular file, or no mmap here, read it instead
+	host_map_cant_open,
+	host_map_too_large,
+	host_map_failed,
+} host_map_result;
+
+// Maps the file at path copy-on-write over the start of memory from
+// host_map_memory, reading its first page so that it stays mirrored. The
+// file can be at most limit bytes (which has to fit in memory), what comes
+// after it stays zero, and it shouldn't shrink while it is mapped. Sets
+// length to the file's size.
+host_map_result host_map_file(char const *path, void *memory, size_t limit, size_t *length);
+
+#endif // HOST_H
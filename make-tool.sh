@@ -3,8 +3,8 @@
 set -e
 
 run_compiler () {
-	local common_objects="vm.c common_ports.c sv.c"
-	local invocation="cc -Wall -Wextra -Werror -pedantic -std=c11 $common_objects $1.c -o $1"
+	local common_objects="vm.c common_ports.c host.c vm_pool.c sv.c"
+	local invocation="cc -Wall -Wextra -Werror -pedantic -std=c11 $CFLAGS $common_objects $1.c -o $1"
 	echo -ne "$1\t"
 	echo "$invocation"
 	$invocation
@@ -13,8 +13,10 @@ run_compiler () {
 if [ -z "$1" ]; then
 	echo "Usage: make-tool.sh tools..."
 	echo -e "\tTools are:"
+	echo -e "\t\taot"
 	echo -e "\t\tassemble"
 	echo -e "\t\tdisassemble"
+	echo -e "\t\tpool"
 	echo -e "\t\trun"
 	echo -e "\t\tstepper"
 	exit 1
@@ -22,10 +24,12 @@ fi
 
 while [ ! -z "$1" ]; do
 	case "$1" in
+		"aot")         run_compiler "aot"         ;;
 		"assemble")    run_compiler "assemble"    ;;
 		"run")         run_compiler "run"         ;;
 		"stepper")     run_compiler "stepper"     ;;
 		"disassemble") run_compiler "disassemble" ;;
+		"pool")        run_compiler "pool"        ;;
 		*)
 			echo "Unknown tool $1"
 			exit 1
@@ -27,6 +27,29 @@
 //
 // up to 256 opcodes
 // up to 4 registers can be used as operands in one instruction
+//
+// memory model
+//
+// Memory is little endian. Every core sees its own loads and stores in
+// program order, but nothing is promised about the order other cores see
+// them in without atomics and fences:
+//
+// - ordinary loads and stores are atomic one byte at a time (a double byte
+//   written by one core may be seen half written by another)
+// - atomics (fetchadd, fetchadd16, cas8, cas16, xchg8, xchg16) are
+//   indivisible, but on their own don't order anything else
+// - fenceacq keeps later loads and stores from moving above earlier loads,
+//   fencerel keeps earlier loads and stores from moving below later stores,
+//   fence does both and also orders stores before later loads
+// - the 16 bit atomics need an even address and fault otherwise
+// - bulk memory instructions are ordinary byte loads and stores, in no
+//   particular order
+//
+// so a spinlock takes a cas8 loop followed by fenceacq, and releases it
+// with fencerel followed by a wab.
+//
+// wait8/wait16 and notify act like fences, so a store followed by a notify
+// can't be missed by a wait that saw the old value.
 // 
 // TODO:
 // 64 opcodes seems like about enough, the upper two bits could be used as
@@ -114,13 +137,79 @@ typedef enum vm_operands {
 	X(Fault,                      "fault",       none    ) /* trigger a manual fault */ \
 	/* Atomics */                                          \
 	X(Fetch_And_Add_Byte,         "fetchadd",    rrr     ) /* (atomically) R1 = memory[R2], memory[R2] = memory[R2] + R3,  */ \
+	X(Fetch_And_Add_Two_Byte,     "fetchadd16",  rrr     ) /* (atomically) R1 <- memory[R2], memory[R2] <- memory[R2] + R3 */ \
+	X(Compare_And_Swap_Byte,      "cas8",        rrrr    ) /* (atomically) R1 <- memory[R2], if it was R3 then memory[R2] <- R4 */ \
+	X(Compare_And_Swap_Two_Byte,  "cas16",       rrrr    ) /* (atomically) R1 <- memory[R2], if it was R3 then memory[R2] <- R4 */ \
+	X(Exchange_Byte,              "xchg8",       rrr     ) /* (atomically) R1 <- memory[R2], memory[R2] <- R3 */ \
+	X(Exchange_Two_Byte,          "xchg16",      rrr     ) /* (atomically) R1 <- memory[R2], memory[R2] <- R3 */ \
+	X(Fence_Acquire,              "fenceacq",    none    ) /* see the memory model above */ \
+	X(Fence_Release,              "fencerel",    none    ) \
+	X(Fence,                      "fence",       none    ) \
+	/* Waiting */                                          \
+	X(Wait_Byte,                  "wait8",       rr      ) /* if memory[R1] = R2, park until a notify on R1 (wakes may be spurious) */ \
+	X(Wait_Two_Byte,              "wait16",      rr      ) /* if memory[R1] = R2 (double byte), park until a notify on R1 */ \
+	X(Notify,                     "notify",      r       ) /* wake every core parked on R1 */ \
+	/* Bulk Memory (addresses wrap around at the end of memory) */ \
+	X(Memory_Copy,                "mcopy",       rrr     ) /* memory[R1 ..] <- memory[R2 ..] for UR3 bytes, as if through a buffer */ \
+	X(Memory_Fill,                "mfill",       rrr     ) /* memory[R1 ..] <- R2 for UR3 bytes */ \
+	X(Memory_Compare,             "mcmp",        rrrr    ) /* R1 <- first offset where memory[R2 ..] and memory[R3 ..] differ, or UR4 if the UR4 bytes match */ \
+	X(Memory_Scan,                "mscan",       rrrr    ) /* R1 <- first offset where memory[R2 ..] = R3, or UR4 if not in the UR4 bytes */ \
+	/* Bits */                                             \
+	X(Population_Count,           "popcnt",      rr      ) /* R1 <- number of set bits in R2 */ \
+	X(Count_Leading_Zeros,        "clz",         rr      ) /* R1 <- zero bits above the highest set bit of R2, 16 if R2 = 0 */ \
+	X(Count_Trailing_Zeros,       "ctz",         rr      ) /* R1 <- zero bits below the lowest set bit of R2, 16 if R2 = 0 */ \
+	X(Bit_Test_And_Set,           "bts",         rrr     ) /* R1 <- bit (UR3 mod 16) of R2, then set it in R2 */ \
+	X(Bit_Test_And_Clear,         "btc",         rrr     ) /* R1 <- bit (UR3 mod 16) of R2, then clear it in R2 */ \
+	X(Byte_Swap,                  "bswap",       rr      ) /* R1 <- R2 with its two bytes swapped */ \
+	/* 32 Bit (register pairs, the high half first) */     \
+	X(Add_Pair,                   "add32",       rrrr    ) /* R1:R2 <- R1:R2 + R3:R4 */ \
+	X(Subtract_Pair,              "sub32",       rrrr    ) /* R1:R2 <- R1:R2 - R3:R4 */ \
+	X(Shift_Left_Pair,            "shl32",       rrr     ) /* R1:R2 <- R1:R2 << (UR3 mod 32) */ \
+	X(Shift_Logical_Right_Pair,   "slr32",       rrr     ) /* R1:R2 <- R1:R2 >> (UR3 mod 32) */ \
+	X(Compare_Unsigned_Pair,      "ucmp32",      rrrr    ) /* R1 <- R1:R2 <= R3:R4, R2 <- R1:R2 > R3:R4 */ \
+	X(Compare_Signed_Pair,        "scmp32",      rrrr    ) /* same as ucmp32, with the pairs as signed 32 bit numbers */ \
+	X(Read_Address_Four_Byte,     "raq",         rrr     ) /* R1:R2 <- memory[R3], R2 from the first two bytes */ \
+	X(Write_Address_Four_Byte,    "waq",         rrr     ) /* memory[R1] <- R2:R3, R3 into the first two bytes */ \
+
+// Instruction sequences the interpreter executes as one when it finds them
+// while filling the decode cache, so only with it. vm_fused_operands in vm.c
+// checks any extra conditions on the operands, the handlers live in
+// vm_interp.c.
+//
+// Sequences shorter than 3 instructions leave the unused ops as Nop.
+//
+//      X(Identifier,                 length, first op,             second op,                  third op)
+
+#define vm_x_fusions(X) \
+	X(Load_Immediate_Double,      2,      Load_Immediate_Byte,  Shift_In_Byte,              Nop                       ) /* lib rA B; sib rA B */ \
+	X(Branch_If_Non_Zero,         2,      Skip_If_Zero,         Branch_Immediate_Absolute,  Nop                       ) /* sz rA; bia D */ \
+	X(Branch_If_Zero,             2,      Skip_If_Non_Zero,     Branch_Immediate_Absolute,  Nop                       ) /* snz rA; bia D */ \
+	X(Read_Branch_If_Non_Zero,    3,      Read_Address_Byte,    Skip_If_Zero,               Branch_Immediate_Absolute ) /* rab rA rB; sz rC; bia D */ \
+	X(Read_Branch_If_Zero,        3,      Read_Address_Byte,    Skip_If_Non_Zero,           Branch_Immediate_Absolute ) /* rab rA rB; snz rC; bia D */ \
+
+#define VM_MAX_FUSION_LENGTH 3
 
 // TODO:
-// bit test/scan?
 // repeat/loop instructions?
 
 #define X(name, mnemonic, encoding) vm_op_##name,
 typedef enum vm_op { vm_x_instructions(X) } vm_op;
 #undef X
 
+#define X(name, mnemonic, encoding) + 1
+enum { vm_op_count = 0 vm_x_instructions(X) };
+#undef X
+
+#define X(name, length, first, second, third) vm_fusion_##name,
+typedef enum vm_fusion { vm_x_fusions(X) } vm_fusion;
+#undef X
+
+#define X(name, length, first, second, third) + 1
+enum { vm_fusion_count = 0 vm_x_fusions(X) };
+#undef X
+
+#define X(name, length, first, second, third) vm_fusion_length_##name = length,
+enum { vm_x_fusions(X) };
+#undef X
+
 #endif // OPS_H
@@ -0,0 +1,147 @@
+#include "vm.h"
+#include "vm_pool.h"
+#include "common_ports.h"
+#include "sv.h"
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm_utils.c"
+
+// Runs each program given as machines of their own on a vm_pool, which is
+// mostly a way to try the pool out with many of them. Every machine has its
+// own common ports, writing to the shut down port stops just that machine.
+
+static void usage(void) {
+	fprintf(stderr, "Usage: pool [-t threads=1] [-c cores=1] [-r copies=1] [-q quantum=1000] [-i] <programs...>\n");
+	fprintf(stderr, "\t-c\tcores of each machine\n");
+	fprintf(stderr, "\t-r\thow many machines to run each program on\n");
+	fprintf(stderr, "\t-q\tinstructions a core runs before the thread moves on to another machine\n");
+	fprintf(stderr, "\t-i\tdon't park cores that spin in idle loops\n");
+}
+
+typedef struct machine {
+	common_port_state ports;
+	char const *file_name;
+	uint32_t copy;
+} machine;
+
+static _Atomic uint32_t faulted_count;
+
+static void stop_write(void *v_instance, uint8_t port_number, uint16_t data) {
+	(void)port_number;
+	(void)data;
+	vm_pool_stop(v_instance);
+}
+
+static void machine_exited(vm_instance *instance) {
+	machine *m = instance->context;
+	if (instance->faulted_core >= 0) {
+		vm_core const *core = &instance->vm.cores[instance->faulted_core];
+		fflush(stdout);
+		printf(
+			"Machine %s#%" PRIu32 " core %" PRId32 " faulted with fault %u (%s) at pc=%04x.\n",
+			m->file_name,
+			m->copy,
+			instance->faulted_core,
+			core->fault,
+			vm_fault_name(core->fault),
+			core->pc
+		);
+		fflush(stdout);
+		atomic_fetch_add(&faulted_count, 1);
+	}
+	free(m);
+	vm_pool_free_instance(instance);
+}
+
+int main(int argc, char **argv) {
+	int thread_count = 1;
+	int core_count = 1;
+	long copies = 1;
+	long quantum = 1000;
+	bool idle_parking = true;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "t:c:r:q:i")) != -1) switch (opt) {
+	case 't': thread_count = atoi(optarg); break;
+	case 'c': core_count = atoi(optarg); break;
+	case 'r': copies = atol(optarg); break;
+	case 'q': quantum = atol(optarg); break;
+	case 'i': idle_parking = false; break;
+	default:
+		usage();
+		return 1;
+	}
+
+	if (thread_count <= 0 || thread_count > UINT16_MAX) {
+		usage();
+		fprintf(stderr, "Invalid thread count given.\n");
+		return 1;
+	}
+	if (core_count <= 0 || core_count > VM_MAX_CORES) {
+		usage();
+		fprintf(stderr, "Invalid core count given.\n");
+		return 1;
+	}
+	if (copies <= 0 || copies > UINT32_MAX) {
+		usage();
+		fprintf(stderr, "Invalid copy count given.\n");
+		return 1;
+	}
+	if (quantum <= 0 || quantum > UINT32_MAX) {
+		usage();
+		fprintf(stderr, "Invalid quantum given.\n");
+		return 1;
+	}
+	if (optind == argc) {
+		usage();
+		fprintf(stderr, "No file name given\n");
+		return 1;
+	}
+
+	vm_pool *pool = vm_pool_create(thread_count, quantum);
+	if (!pool) {
+		fprintf(stderr, "Could not create the pool.\n");
+		return 1;
+	}
+
+	for (int file = optind; file < argc; ++file) {
+		// The file is read into the first copy, which the others are forked
+		// from. It starts last so it can't exit (and be freed) before them.
+		vm_instance *first = NULL;
+		for (uint32_t copy = 0; copy < copies; ++copy) {
+			vm_instance *instance = first ? vm_pool_fork(first) : vm_pool_new_instance(pool, core_count);
+			machine *m = malloc(sizeof *m);
+			if (!instance || !m) {
+				fprintf(stderr, "Could not allocate machine %s#%" PRIu32 ".\n", argv[file], copy);
+				return 1;
+			}
+			m->file_name = argv[file];
+			m->copy = copy;
+
+			if (!first) {
+				map_file_to_vm_memory(&instance->vm, argv[file]);
+				instance->vm.idle_parking = idle_parking;
+				instance->on_exit = machine_exited;
+				// without shared memory the forks copy it instead
+				if (copies > 1) vm_pool_make_template(instance);
+			}
+			vm_install_common_ports(&instance->vm, &m->ports);
+			vm_register_port(&instance->vm, common_port_shut_down, (vm_port){ .context = instance, .write = stop_write, .stop = true });
+			instance->context = m;
+
+			if (first) vm_pool_start(instance);
+			else first = instance;
+		}
+		vm_pool_start(first);
+	}
+
+	vm_pool_wait(pool);
+	vm_pool_destroy(pool);
+	return atomic_load(&faulted_count) > 0;
+}
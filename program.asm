@@ -23,22 +23,29 @@
 	ncores r1
 	dec r2 r1 1
 	wab r0 r1
+	notify r0
 
 	; when other cores are done they will decrement init lock
 @main-spin:
 	rab r1 r0
-	sz r1
+	snz r1
+	bia abs@main-done
+	wait8 r0 r1
 	bia abs@main-spin
 
+@main-done:
+
 	lib r0 10
 	portw r0 %terminal-output
 
 	portw r0 %power-port
 
 @aux-cores: ; core# is in r1
+	lib r3 0
 @spin-on-init-lock:
-	rab r3 r0
-	snz r3
+	wait8 r0 r3
+	rab r4 r0
+	snz r4
 	bia abs@spin-on-init-lock
 
 	lib r4 32
@@ -47,8 +54,13 @@
 
 	lib r4 #ff
 	fetchadd r4 r0 r4
+	notify r0
 
-	; spin
-	bia .
+	; park for good, nothing writes to the byte after the init lock
+	lib r5 abshi@parked sib r5 abslo@parked
+@park:
+	wait8 r5 r3
+	bia abs@park
 
 >0100 @init-lock:
+>0101 @parked:
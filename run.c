@@ -1,42 +1,145 @@
 #include "vm.h"
 #include "common_ports.h"
+#include "host.h"
 #include "sv.h"
 
 #define _XOPEN_SOURCE 1
 
 #include <getopt.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <time.h>
 #include <stdlib.h>
 #include <threads.h>
 
 #include "vm_utils.c"
+#include "scheduler.c"
+
+// Programs written by the aot tool include this file with the image they
+// were translated from in RUN_EMBEDDED_IMAGE and their own vm_run in
+// RUN_VM_RUN.
+#ifdef RUN_EMBEDDED_IMAGE
+#define RUN_USAGE_PROGRAM ""
+#else
+#define RUN_USAGE_PROGRAM " <program>"
+#endif
+
+#ifndef RUN_VM_RUN
+#define RUN_VM_RUN vm_run
+#endif
 
 static void usage(void) {
-	fprintf(stderr, "Usage: run [-c cores=1] [-t threads=1] <program>\n");
+	fprintf(stderr, "Usage: run [-c cores=1] [-t threads=1] [-d dispatch=threaded|switch] [-j] [-s] [-i] [-b block file] [-S scheduler=random|round-robin|priority] [-q quantum=1000] [-p priorities] [-a cpus] [-n node]" RUN_USAGE_PROGRAM "\n");
+	fprintf(stderr, "\t-j\tcompile hot code to native code\n");
+	fprintf(stderr, "\t-s\tprint statistics and how long the machine ran to stderr on exit\n");
+	fprintf(stderr, "\t-i\tdon't park cores that spin in idle loops\n");
+	fprintf(stderr, "\t-b\tattach a file as a block device\n");
+	fprintf(stderr, "\t-S\thow cores are picked to run, each for a quantum of instructions\n");
+	fprintf(stderr, "\t-p\tcomma separated priorities of the cores for -S priority, higher runs first\n");
+	fprintf(stderr, "\t-a\tpin each thread to one of a list of CPUs like 0-3,8, in turn\n");
+	fprintf(stderr, "\t-n\tput the machine's memory on a NUMA node, and threads on its CPUs without -a\n");
 }
 
-typedef struct thread_data {
-	uint8_t first_core, core_count; // the range of cores this thread is responsible for driving
-	uint64_t rng_state;
-} thread_data;
 int thread_func(void *);
-static vm_core core_storage[256];
+static int run_threads(int thread_count);
+static void wake_idle_threads(vm_state *);
+static scheduler_policy policy = scheduler_random;
+static uint32_t quantum = 1000;
+static uint8_t *priorities; // one per core
+// one per host thread, each starts with a range of the cores
+static scheduler *schedulers;
+static uint16_t scheduler_count;
+// thread i runs on pin_cpus.cpus[i % pin_cpus.count], unpinned when empty
+static host_cpu_list pin_cpus;
+static vm_core *core_storage;
+static uint8_t *memory; // from host_map_memory
 static common_port_state state;
 static vm_state vm;
 
+// threads whose cores are all parked sleep on idle_wake, checking for a shut
+// down every idle_check_ns in case nobody notifies them
+static mtx_t idle_lock;
+static cnd_t idle_wake;
+static long const idle_check_ns = 10000000;
+
+// A faulting core is reported and taken off its scheduler while the others
+// go on. run exits with the first fault, once the machine shuts down or
+// nothing is left that can run (see scheduler_machine_stuck).
+static _Atomic uint8_t first_fault;
+static _Atomic bool stuck;
+
+// from the threads starting to the last one finishing, for -s
+static struct timespec started, stopped;
+
+static void print_stats(void) {
+	long long const ms = (stopped.tv_sec - started.tv_sec) * 1000ll + (stopped.tv_nsec - started.tv_nsec) / 1000000;
+	fprintf(stderr, "Ran for %lld ms\n", ms);
+	fprintf(stderr, "Fused instructions:\n");
+	for (uint8_t i = 0; i < vm_fusion_count; ++i)
+		fprintf(stderr, "  %-24s %" PRIu64 "\n", vm_fusion_name(i), (uint64_t)vm.fusions_fired[i]);
+	if (vm.jit)
+		fprintf(stderr, "Compiled blocks: %" PRIu32 "\n", vm_jit_block_count(&vm));
+	if (vm.idle_parking)
+		fprintf(stderr, "Cores parked in idle loops: %" PRIu32 "\n", (uint32_t)vm.idle_parks);
+	if (scheduler_count > 1) {
+		uint64_t stolen = 0;
+		for (uint16_t i = 0; i < scheduler_count; ++i)
+			stolen += schedulers[i].stolen;
+		fprintf(stderr, "Cores stolen by other threads: %" PRIu64 "\n", stolen);
+	}
+}
+
 int main(int argc, char **argv) {
-	char const *file_name = "";
 	int core_count = 1;
 	int thread_count = 1;
+	vm_dispatch dispatch = vm_dispatch_threaded;
+	bool show_stats = false;
+	bool use_jit = false;
+	bool idle_parking = true;
+	char const *block_file_name = NULL;
+	char const *priority_list = NULL;
+	int numa_node = -1;
+	long quantum_given = quantum;
 
 	int opt;
-	while ((opt = getopt(argc, argv, "c:t:")) != -1) switch (opt) {
+	while ((opt = getopt(argc, argv, "c:t:d:jsib:S:q:p:a:n:")) != -1) switch (opt) {
+	case 'b': block_file_name = optarg; break;
+	case 's': show_stats = true; break;
+	case 'i': idle_parking = false; break;
+	case 'q': quantum_given = atol(optarg); break;
+	case 'p': priority_list = optarg; break;
+	case 'n': numa_node = atoi(optarg); break;
+	case 'a':
+		if (!host_parse_cpu_list(optarg, &pin_cpus)) {
+			usage();
+			fprintf(stderr, "Invalid CPU list given.\n");
+			return 1;
+		}
+		break;
+	case 'S':
+		if (!scheduler_policy_from_name(optarg, &policy)) {
+			usage();
+			fprintf(stderr, "Unknown scheduler \"%s\".\n", optarg);
+			return 1;
+		}
+		break;
+	case 'j': use_jit = true; break;
 	case 'c': core_count = atoi(optarg); break;
 	case 't': thread_count = atoi(optarg); break;
+	case 'd':
+		if (sv_eq(sv_from_c(optarg), sv_c("threaded"))) {
+			dispatch = vm_dispatch_threaded;
+		} else if (sv_eq(sv_from_c(optarg), sv_c("switch"))) {
+			dispatch = vm_dispatch_switch;
+		} else {
+			usage();
+			fprintf(stderr, "Unknown dispatch \"%s\".\n", optarg);
+			return 1;
+		}
+		break;
 	}
 
-	if (core_count <= 0 || core_count >= 256) {
+	if (core_count <= 0 || core_count > VM_MAX_CORES) {
 		usage();
 		fprintf(stderr, "Invalid core count given.\n");
 		return 1;
@@ -50,44 +153,146 @@ int main(int argc, char **argv) {
 		fprintf(stderr, "Thread count can't be greater than core count\n");
 		return 1;
 	}
+	if (quantum_given <= 0 || quantum_given > UINT32_MAX) {
+		usage();
+		fprintf(stderr, "Invalid quantum given.\n");
+		return 1;
+	}
+	quantum = quantum_given;
 
+	// the cores take a cache line each, 10000 of them are 640KiB. They and
+	// the schedulers get pages of their own for -n to place.
+	core_storage = host_alloc_pages(core_count * sizeof(vm_core));
+	schedulers = host_alloc_pages(thread_count * sizeof *schedulers);
+	priorities = calloc(core_count, 1);
+	if (!core_storage || !schedulers || !priorities) {
+		fprintf(stderr, "Could not allocate the cores.\n");
+		return 1;
+	}
+	memory = host_map_memory(VM_MEMORY_SIZE);
+	if (!memory) {
+		fprintf(stderr, "Could not allocate the machine's memory.\n");
+		return 1;
+	}
+	if (priority_list && !scheduler_parse_priorities(priority_list, priorities, core_count)) {
+		usage();
+		fprintf(stderr, "Invalid priorities given.\n");
+		return 1;
+	}
+
+#ifndef RUN_EMBEDDED_IMAGE
 	if (optind == argc) {
 		usage();
 		fprintf(stderr, "No file name given\n");
 		return 1;
 	}
 
-	file_name = argv[optind];
+	char const *file_name = argv[optind];
+#endif
+
+	vm_init(&vm, core_count, core_storage, memory);
+#ifdef RUN_EMBEDDED_IMAGE
+	memcpy(vm.memory, RUN_EMBEDDED_IMAGE, sizeof RUN_EMBEDDED_IMAGE);
+#else
+	// before memory is placed on a node below, mapping the program over
+	// it afterwards would leave its pages out
+	map_file_to_vm_memory(&vm, file_name);
+#endif
 
-	vm_init(&vm, core_count, core_storage);
+	if (numa_node >= 0) {
+		// vm itself is in .bss with whatever else the linker put there,
+		// so it stays where it is
+		bool placed = host_place_on_node(memory, VM_MEMORY_SIZE, numa_node)
+			&& host_place_on_node(core_storage, core_count * sizeof(vm_core), numa_node)
+			&& host_place_on_node(schedulers, thread_count * sizeof *schedulers, numa_node);
+		if (!placed)
+			fprintf(stderr, "NUMA node %d is not available, leaving memory placement to the OS.\n", numa_node);
+		else if (pin_cpus.count == 0)
+			host_node_cpus(numa_node, &pin_cpus);
+	}
+	// this thread is (or waits for) thread 0, checking the first CPU here
+	// saves every thread complaining
+	if (pin_cpus.count > 0 && !host_pin_thread(pin_cpus.cpus[0])) {
+		fprintf(stderr, "Could not pin threads to CPU %u, leaving them unpinned.\n", pin_cpus.cpus[0]);
+		pin_cpus.count = 0;
+	}
+
+	vm.dispatch = dispatch;
+	vm.idle_parking = idle_parking;
 	vm_install_common_ports(&vm, &state);
-	read_file_to_vm_memory(&vm, file_name);
+	// translated code only leaves the odd instruction to the interpreter,
+	// so it goes without the decode cache
+#ifndef RUN_EMBEDDED_IMAGE
+	if (!vm_enable_decode_cache(&vm)) {
+		fprintf(stderr, "Could not allocate the decode cache.\n");
+		return 1;
+	}
+#endif
+	if (use_jit && !vm_enable_jit(&vm)) {
+		fprintf(stderr, "Could not enable the JIT.\n");
+		return 1;
+	}
+
+	if (block_file_name && !common_ports_attach_block_device(&vm, &state, block_file_name)) {
+		fprintf(stderr, "Could not map block device file \"%s\".\n", block_file_name);
+		return 1;
+	}
+
+	if (!common_ports_buffer_output(&vm, &state)) {
+		fprintf(stderr, "Could not start the terminal output thread.\n");
+		return 1;
+	}
+	if (!common_ports_nonblocking_input(&vm, &state)) {
+		fprintf(stderr, "Could not start the terminal input thread.\n");
+		return 1;
+	}
+
+	if (mtx_init(&idle_lock, mtx_plain) != thrd_success || cnd_init(&idle_wake) != thrd_success) {
+		fprintf(stderr, "Could not create the idle thread lock.\n");
+		return 1;
+	}
+	vm.on_wake = wake_idle_threads;
 
 	srand(time(0));
 
+	int result = 0;
+	uint16_t cores_per_thread = core_count / thread_count;
+	uint16_t remainder = core_count % thread_count;
+	for (uint16_t i = 0; i < thread_count; ++i) {
+		uint16_t count = cores_per_thread;
+		if (i == thread_count - 1)
+			count += remainder;
+		if (!scheduler_init(&schedulers[i], policy, quantum, cores_per_thread * i, count, core_count, rand())) {
+			fprintf(stderr, "Could not create the schedulers.\n");
+			return 1;
+		}
+		schedulers[i].priorities = priorities;
+	}
+	scheduler_count = thread_count;
+
+	timespec_get(&started, TIME_UTC);
 	if (thread_count == 1) {
 		// don't bother spawning threads if we just need one
-		return thread_func(&(thread_data){
-			.first_core = 0,
-			.core_count = core_count,
-			.rng_state = rand(),
-		});
+		result = thread_func(&schedulers[0]);
+	} else {
+		result = run_threads(thread_count);
 	}
+	timespec_get(&stopped, TIME_UTC);
+	if (result == 0)
+		result = first_fault;
 
-	uint8_t cores_per_thread = core_count / thread_count;
-	uint8_t remainder = core_count % thread_count;
+	common_ports_stop_input(&vm, &state);
+	common_ports_stop_output(&vm, &state);
+	common_ports_detach_block_device(&vm, &state);
+	if (show_stats)
+		print_stats();
+	return result;
+}
 
+static int run_threads(int thread_count) {
 	static thrd_t threads[256];
-	static thread_data thread_data_storage[256];
 	for (uint8_t i = 0; i < thread_count; ++i) {
-		thread_data_storage[i] = (thread_data){
-			.first_core = cores_per_thread * i,
-			.core_count = cores_per_thread,
-			.rng_state = rand(),
-		};
-		if (i == thread_count - 1)
-			thread_data_storage[i].core_count += remainder;
-		if (thrd_create(&threads[i], thread_func, &thread_data_storage[i]) != thrd_success) {
+		if (thrd_create(&threads[i], thread_func, &schedulers[i]) != thrd_success) {
 			fprintf(stderr, "Failed to spawn a thread\n");
 			return 1;
 		}
@@ -95,33 +300,91 @@ int main(int argc, char **argv) {
 
 	for (uint8_t i = 0; i < thread_count; ++i)
 		thrd_join(threads[i], NULL);
+	return 0;
 }
 
-uint64_t rng_next(uint64_t *state) {
-	uint64_t x = *state;
-	x ^= x << 13;
-	x ^= x >> 7;
-	x ^= x << 17;
-	return *state = x;
+// a notify or a write woke some cores, any of them may belong to a sleeping thread
+static void wake_idle_threads(vm_state *vm) {
+	(void)vm;
+	mtx_lock(&idle_lock);
+	cnd_broadcast(&idle_wake);
+	mtx_unlock(&idle_lock);
 }
 
-int thread_func(void *data_) {
-	thread_data *data = data_;
+// sleeps until a core wakes up, or for idle_check_ns to look for cores to
+// steal again
+static void sleep_while_parked(scheduler *s) {
+	// cores parked for good would keep a machine with a faulted core from
+	// ever ending
+	if (atomic_load(&first_fault) && scheduler_machine_stuck(schedulers, scheduler_count, &vm)) {
+		stuck = true;
+		wake_idle_threads(&vm);
+		return;
+	}
 
-	for (; !state.wrote_to_shut_down;) {
-		uint8_t core_index = data->first_core + rng_next(&data->rng_state) % data->core_count;
-		vm_step(&vm, core_index);
+	mtx_lock(&idle_lock);
+	// checked under the lock so that a wake up can't slip in before we wait,
+	// including one of a core another thread has but isn't running
+	if (scheduler_all_parked(s, &vm) && !scheduler_steal(s, schedulers, scheduler_count) && !state.wrote_to_shut_down && !stuck) {
+		struct timespec until;
+		timespec_get(&until, TIME_UTC);
+		until.tv_nsec += idle_check_ns;
+		if (until.tv_nsec >= 1000000000) {
+			until.tv_sec += 1;
+			until.tv_nsec -= 1000000000;
+		}
+		cnd_timedwait(&idle_wake, &idle_lock, &until);
+	}
+	mtx_unlock(&idle_lock);
+
+	// a write that raced with a core parking in an idle loop may not have
+	// woken it
+	scheduler_recheck_idle(s, &vm);
+}
+
+int thread_func(void *s_) {
+	scheduler *s = s_;
+
+	if (pin_cpus.count > 0) {
+		host_pin_thread(pin_cpus.cpus[(s - schedulers) % pin_cpus.count]);
+		// and bring the cores we start with over to our node, cores other
+		// threads steal later stay where they are
+		mtx_lock(&s->lock);
+		if (s->count > 0)
+			host_place_near_thread(&vm.cores[s->ring[0]], s->count * sizeof(vm_core));
+		mtx_unlock(&s->lock);
+	}
+
+	for (; !state.wrote_to_shut_down && !stuck;) {
+		int32_t const core_index = scheduler_next(s, &vm);
+		if (core_index < 0) {
+			// nothing of ours can run, help out another thread if we can
+			if (!scheduler_steal(s, schedulers, scheduler_count))
+				sleep_while_parked(s);
+			continue;
+		}
 
-		if (vm.cores[core_index].fault != vm_fault_none) {
+		// the core may park or stop for a portw before its quantum is up,
+		// it keeps the rest of it unless it parked
+		uint32_t ran;
+		vm_run_result result = RUN_VM_RUN(&vm, core_index, s->left, &ran);
+		if (result == vm_run_faulted) {
+			// so that everything the guest wrote comes before the message
+			common_ports_flush_output(&state);
 			printf(
-				"Machine core %u faulted with fault %u (%s) at pc=%04x.\n",
+				"Machine core %" PRId32 " faulted with fault %u (%s) at pc=%04x.\n",
 				core_index,
 				vm.cores[core_index].fault,
 				vm_fault_name(vm.cores[core_index].fault),
 				vm.cores[core_index].pc
 			);
-			return vm.cores[core_index].fault;
+			fflush(stdout);
+			uint8_t none = vm_fault_none;
+			atomic_compare_exchange_strong(&first_fault, &none, vm.cores[core_index].fault);
+			scheduler_retire(s);
+			continue;
 		}
+		scheduler_used(s, ran);
 	}
 
 	return 0;
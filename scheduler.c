@@ -0,0 +1,293 @@
+// Picks which core a host thread runs next, shared by run and stepper.
+// Include after vm.h and sv.h.
+//
+// With several host threads each gets a scheduler of its own over some of
+// the cores. A thread that has nothing to run takes a core from the back of
+// another's (scheduler_steal), so cores move to wherever there is time to
+// run them. A core leaves a scheduler under its lock and joins the other
+// under that one's, never while it is running, so whatever the last thread
+// that ran it did happens before the next one runs it.
+
+#include <stdlib.h>
+#include <threads.h>
+
+typedef enum scheduler_policy {
+	scheduler_round_robin, // each core in turn
+	scheduler_random,      // a random core each time
+	scheduler_priority,    // always the highest priority core that isn't parked, in turn with its equals
+} scheduler_policy;
+
+// threads keep their schedulers in one array, each starts a cache line of
+// its own so they don't share one
+typedef struct scheduler {
+	_Alignas(VM_CACHE_LINE) scheduler_policy policy;
+	uint32_t quantum; // how many instructions a core runs before another one is picked
+	uint8_t const *priorities; // indexed by core, only used by scheduler_priority
+
+	// Cores that can run wait in a ring, taken from the front and put back
+	// at the back, other schedulers steal from the back. Cores that parked
+	// wait in parked until vm->wakes says some woke. Both have room for
+	// every core of the machine, they could all end up here.
+	mtx_t lock;
+	uint16_t *ring;
+	uint32_t capacity, front, count; // of ring
+	uint16_t *parked;
+	uint32_t parked_count;
+	uint32_t wakes_seen;
+
+	int32_t current; // off the ring until its quantum is up or it parks, -1 for none
+	bool running; // current is being run right now
+	_Atomic bool taking; // a steal is moving a core here, see scheduler_stuck
+	uint32_t left; // of the quantum of current
+	uint64_t rng_state;
+	uint32_t stolen; // cores taken from other schedulers so far
+
+} scheduler;
+
+// bumped whenever a core is run, retired or stolen, see scheduler_machine_stuck
+static _Atomic uint64_t scheduler_progress;
+
+static bool scheduler_policy_from_name(char const *name, scheduler_policy *policy) {
+	sv const s = sv_from_c(name);
+	if (sv_eq(s, sv_c("round-robin"))) *policy = scheduler_round_robin;
+	else if (sv_eq(s, sv_c("random"))) *policy = scheduler_random;
+	else if (sv_eq(s, sv_c("priority"))) *policy = scheduler_priority;
+	else return false;
+	return true;
+}
+
+// Reads priorities for the first cores from a comma separated list like
+// "3,0,1", cores it doesn't mention keep theirs. Higher runs first.
+static bool scheduler_parse_priorities(char const *list, uint8_t *priorities, uint16_t core_count) {
+	for (uint16_t core = 0; *list; ++core) {
+		char *end;
+		long priority = strtol(list, &end, 10);
+		if (end == list || priority < 0 || priority > UINT8_MAX || core >= core_count)
+			return false;
+		priorities[core] = priority;
+		if (*end == ',') ++end;
+		else if (*end) return false;
+		list = end;
+	}
+	return true;
+}
+
+// false if the lock or the lists of cores could not be created
+static bool scheduler_init(scheduler *s, scheduler_policy policy, uint32_t quantum, uint16_t first_core, uint16_t core_count, uint16_t total_cores, uint64_t seed) {
+	s->policy = policy;
+	s->quantum = quantum;
+	s->priorities = NULL;
+	s->ring = malloc(total_cores * sizeof *s->ring);
+	s->parked = malloc(total_cores * sizeof *s->parked);
+	if (!s->ring || !s->parked) return false;
+	// starting on the first core, the others come after it in turn
+	s->capacity = total_cores;
+	s->front = 0;
+	s->count = core_count;
+	for (uint32_t i = 0; i < core_count; ++i)
+		s->ring[i] = first_core + i;
+	s->parked_count = 0;
+	s->wakes_seen = 0;
+	s->current = -1;
+	s->running = false;
+	atomic_init(&s->taking, false);
+	s->left = 0;
+	s->rng_state = seed | 1; // xorshift gets stuck on 0
+	s->stolen = 0;
+	return mtx_init(&s->lock, mtx_plain) == thrd_success;
+}
+
+static uint64_t scheduler_rng_next(uint64_t *state) {
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+// the ring, under the lock
+static inline uint16_t *scheduler_at(scheduler *s, uint32_t i) {
+	return &s->ring[(s->front + i) % s->capacity];
+}
+
+static inline void scheduler_push_back(scheduler *s, uint16_t core) {
+	*scheduler_at(s, s->count++) = core;
+}
+
+static inline uint16_t scheduler_pop_front(scheduler *s) {
+	uint16_t const core = *scheduler_at(s, 0);
+	s->front = (s->front + 1) % s->capacity;
+	s->count -= 1;
+	return core;
+}
+
+// Puts cores in parked that woke since it last looked back on the ring.
+// Only a core being run can park, so the ring never has parked cores.
+static void scheduler_take_woken(scheduler *s, vm_state *vm) {
+	uint32_t const wakes = atomic_load_explicit(&vm->wakes, memory_order_acquire);
+	if (wakes == s->wakes_seen && s->count > 0) return;
+	s->wakes_seen = wakes;
+	uint32_t kept = 0;
+	for (uint32_t i = 0; i < s->parked_count; ++i) {
+		uint16_t const core = s->parked[i];
+		if (vm_core_parked(&vm->cores[core])) s->parked[kept++] = core;
+		else scheduler_push_back(s, core);
+	}
+	s->parked_count = kept;
+}
+
+// The core to run next and how much of its quantum is left in s->left, or
+// -1 if every core is parked. Keeps picking the same core until its
+// quantum is used up or it parks. The core belongs to the caller until it
+// calls scheduler_used.
+//
+// Round robin and random picks take the same time however many cores there
+// are, priority looks through the ring for the highest one.
+static int32_t scheduler_next(scheduler *s, vm_state *vm) {
+	mtx_lock(&s->lock);
+	if (s->current >= 0) {
+		bool const parked = vm_core_parked(&vm->cores[s->current]);
+		if (s->left > 0 && !parked) {
+			s->running = true;
+			mtx_unlock(&s->lock);
+			return s->current;
+		}
+		if (parked) s->parked[s->parked_count++] = s->current;
+		else scheduler_push_back(s, s->current);
+		s->current = -1;
+	}
+
+	scheduler_take_woken(s, vm);
+	if (s->count > 0) {
+		uint32_t pick = 0;
+		if (s->policy == scheduler_random) {
+			pick = scheduler_rng_next(&s->rng_state) % s->count;
+		} else if (s->policy == scheduler_priority) {
+			for (uint32_t i = 1; i < s->count; ++i)
+				if (s->priorities[*scheduler_at(s, i)] > s->priorities[*scheduler_at(s, pick)])
+					pick = i;
+		}
+		// take the pick out of the ring, priority keeps the rest in order so
+		// that equals go in turn, the others move the front into its place
+		uint16_t const core = *scheduler_at(s, pick);
+		if (s->policy == scheduler_priority) {
+			for (uint32_t i = pick; i > 0; --i)
+				*scheduler_at(s, i) = *scheduler_at(s, i - 1);
+		} else {
+			*scheduler_at(s, pick) = *scheduler_at(s, 0);
+		}
+		scheduler_pop_front(s);
+		s->current = core;
+		s->left = s->quantum;
+		s->running = true;
+	}
+
+	int32_t const result = s->current;
+	mtx_unlock(&s->lock);
+	return result;
+}
+
+// tells the scheduler the core scheduler_next gave out ran for steps of
+// its quantum
+static void scheduler_used(scheduler *s, uint32_t steps) {
+	mtx_lock(&s->lock);
+	s->left = steps < s->left ? s->left - steps : 0;
+	s->running = false;
+	atomic_fetch_add(&scheduler_progress, 1);
+	mtx_unlock(&s->lock);
+}
+
+// takes the core scheduler_next gave out off s for good, once it faulted
+static inline void scheduler_retire(scheduler *s) {
+	mtx_lock(&s->lock);
+	s->current = -1;
+	s->left = 0;
+	s->running = false;
+	atomic_fetch_add(&scheduler_progress, 1);
+	mtx_unlock(&s->lock);
+}
+
+// Moves the core at the back of one of the other schedulers' rings to the
+// back of s, trying them from a random one on. Returns whether it found
+// one. Only one lock is held at a time: the core leaves under the lock of
+// the scheduler it was on and joins under the lock of s.
+static inline bool scheduler_steal(scheduler *s, scheduler *all, uint16_t count) {
+	// the core is on neither scheduler in between, which scheduler_stuck
+	// and scheduler_machine_stuck have to know about
+	atomic_store(&s->taking, true);
+	atomic_fetch_add(&scheduler_progress, 1);
+
+	uint16_t const start = scheduler_rng_next(&s->rng_state) % count;
+	int32_t core = -1;
+	for (uint16_t tried = 0; tried < count && core < 0; ++tried) {
+		scheduler *victim = &all[(start + tried) % count];
+		if (victim == s) continue;
+		mtx_lock(&victim->lock);
+		if (victim->count > 0)
+			core = victim->ring[(victim->front + --victim->count) % victim->capacity];
+		mtx_unlock(&victim->lock);
+	}
+
+	if (core >= 0) {
+		mtx_lock(&s->lock);
+		scheduler_push_back(s, core);
+		s->stolen += 1;
+		mtx_unlock(&s->lock);
+	}
+	atomic_store(&s->taking, false);
+	return core >= 0;
+}
+
+// under the lock
+static bool scheduler_all_parked_locked(scheduler *s, vm_state *vm) {
+	if (s->count > 0) return false;
+	if (s->current >= 0 && !vm_core_parked(&vm->cores[s->current])) return false;
+	for (uint32_t i = 0; i < s->parked_count; ++i)
+		if (!vm_core_parked(&vm->cores[s->parked[i]])) return false;
+	return true;
+}
+
+// whether every core s has is parked (or it has none)
+static inline bool scheduler_all_parked(scheduler *s, vm_state *vm) {
+	mtx_lock(&s->lock);
+	bool const parked = scheduler_all_parked_locked(s, vm);
+	mtx_unlock(&s->lock);
+	return parked;
+}
+
+// whether s isn't running or stealing a core and every core it has is parked
+static inline bool scheduler_stuck(scheduler *s, vm_state *vm) {
+	mtx_lock(&s->lock);
+	bool const stuck = !s->running && !atomic_load(&s->taking) && scheduler_all_parked_locked(s, vm);
+	mtx_unlock(&s->lock);
+	return stuck;
+}
+
+// vm_recheck_idle on every parked core s has, outside the lock since
+// waking cores calls vm->on_wake
+static inline void scheduler_recheck_idle(scheduler *s, vm_state *vm) {
+	for (uint32_t i = 0;; ++i) {
+		mtx_lock(&s->lock);
+		int32_t core = i < s->parked_count ? s->parked[i]
+			: i == s->parked_count ? s->current
+			: -1;
+		mtx_unlock(&s->lock);
+		if (core < 0) return;
+		vm_recheck_idle(vm, core);
+	}
+}
+
+// Whether every core left on all of the schedulers is parked with none
+// being run, so nothing can wake them anymore. Idle cores that missed a
+// write are woken first. A core run or moved while the schedulers were
+// looked at shows up in scheduler_progress, one being stolen in between
+// two of them in taking.
+static inline bool scheduler_machine_stuck(scheduler *all, uint16_t count, vm_state *vm) {
+	uint64_t const before = atomic_load(&scheduler_progress);
+	for (uint16_t i = 0; i < count; ++i)
+		scheduler_recheck_idle(&all[i], vm);
+	for (uint16_t i = 0; i < count; ++i)
+		if (!scheduler_stuck(&all[i], vm))
+			return false;
+	return atomic_load(&scheduler_progress) == before;
+}
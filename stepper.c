@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <getopt.h>
 #include <stdbool.h>
 #include <string.h>
 #include <stdio.h>
@@ -71,95 +72,121 @@ static void show_delta(
 }
 
 #include "vm_utils.c"
+#include "scheduler.c"
 
 static void copy_vm_state(vm_state *to, vm_state const *from) {
 	assert(from->core_count == to->core_count);
 	memcpy(to->cores, from->cores, from->core_count * sizeof(vm_core));
-	memcpy(to->memory, from->memory, sizeof from->memory);
+	memcpy(to->memory, from->memory, VM_MEMORY_SIZE);
 }
 
 static void usage(void) {
-	fprintf(stderr, "Usage: stepper [-c cores=1] <program.asm>\n");
+	fprintf(stderr, "Usage: stepper [-c cores=1] [-S scheduler=random|round-robin|priority] [-q quantum=1] [-p priorities] <program.asm>\n");
 }
 
 int main(int argc, char **argv) {
-	char const *file_name = "";
 	int core_count = 1;
-
-	switch (argc) {
-	default: usage(); return 1;
-
-	case 2: {
-		sv arg = sv_from_c(argv[1]);
-		if (sv_starts_with(arg, sv_c("-c"))) { usage(); return 1; }
-		file_name = argv[1];
-		break;
-	}
-	case 3: {
-		sv arg = sv_from_c(argv[1]);
-		if (!sv_starts_with(arg, sv_c("-c"))) { usage(); return 1; }
-		sv_chop(&arg, 2);
-		core_count = atoi(arg.data);
-		file_name = argv[2];
+	scheduler_policy policy = scheduler_random;
+	int quantum = 1;
+	char const *priority_list = NULL;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "c:S:q:p:")) != -1) switch (opt) {
+	case 'c': core_count = atoi(optarg); break;
+	case 'q': quantum = atoi(optarg); break;
+	case 'p': priority_list = optarg; break;
+	case 'S':
+		if (!scheduler_policy_from_name(optarg, &policy)) {
+			usage();
+			fprintf(stderr, "Unknown scheduler \"%s\".\n", optarg);
+			return 1;
+		}
 		break;
+	default: usage(); return 1;
 	}
 
-	case 4: {
-		if (!sv_eq(sv_c("-c"), sv_from_c(argv[1]))) { usage(); return 1; }
-		core_count = atoi(argv[2]);
-		file_name = argv[3];
-		break;
-	}
-	}
+	if (optind != argc - 1) { usage(); return 1; }
+	char const *file_name = argv[optind];
 
-	if (core_count <= 0 || core_count >= 256) {
+	if (core_count <= 0 || core_count > VM_MAX_CORES) {
 		usage();
 		fprintf(stderr, "Invalid core count given.");
 		return 1;
 	}
-
-	static vm_core core_storage[512];
+	if (quantum <= 0) {
+		usage();
+		fprintf(stderr, "Invalid quantum given.\n");
+		return 1;
+	}
+	uint8_t *priorities = calloc(core_count, 1);
+	// now and prev each need a copy of the cores
+	vm_core *core_storage = aligned_alloc(VM_CACHE_LINE, 2 * core_count * sizeof(vm_core));
+	if (!priorities || !core_storage) {
+		fprintf(stderr, "Could not allocate the cores.\n");
+		return 1;
+	}
+	if (priority_list && !scheduler_parse_priorities(priority_list, priorities, core_count)) {
+		usage();
+		fprintf(stderr, "Invalid priorities given.\n");
+		return 1;
+	}
 
 	common_port_state state;
 	vm_state prev, now;
-	vm_init(&now, core_count, core_storage);
+	uint8_t *memory = host_map_memory(VM_MEMORY_SIZE);
+	static _Alignas(2) uint8_t prev_memory[VM_MEMORY_SIZE];
+	if (!memory) {
+		fprintf(stderr, "Could not allocate the machine's memory.\n");
+		return 1;
+	}
+	vm_init(&now, core_count, core_storage, memory);
 	prev.cores = core_storage + core_count;
 	prev.core_count = core_count;
+	prev.memory = prev_memory;
 
 	vm_install_common_ports(&prev, &state);
 	vm_install_common_ports(&now, &state);
 
-	read_file_to_vm_memory(&now, file_name);
+	map_file_to_vm_memory(&now, file_name);
 
 	copy_vm_state(&prev, &now);
 
 	show_delta(&prev, &now);
 
-	// TODO: implement some better scheduling algorithms and let user select from cli
-	srand(time(0));
+	scheduler scheduler;
+	if (!scheduler_init(&scheduler, policy, quantum, 0, core_count, core_count, time(0))) {
+		fprintf(stderr, "Could not create the scheduler.\n");
+		return 1;
+	}
+	scheduler.priorities = priorities;
+
+	while (!state.wrote_to_shut_down) {
+		// parked cores wait for another core to notify them
+		int32_t const core_index = scheduler_next(&scheduler, &now);
+		if (core_index < 0) {
+			printf("Every core is parked, nothing can wake them.\n");
+			return 0;
+		}
 
-	for (uint8_t core_index = 0; !state.wrote_to_shut_down;) {
 		printf(
-			"\nCore %u, Next instruction: \033[1m%s\033[0m (raw %02x %02x %02x)\nPress enter to continue, Control+C to quit.\n",
+			"\nCore %d, Next instruction: \033[1m%s\033[0m (raw %02x %02x %02x)\nPress enter to continue, Control+C to quit.\n",
 			core_index,
 			vm_disasm_pc(&now, core_index),
 			now.memory[now.cores[core_index].pc],
-			now.memory[now.cores[core_index].pc + 1],
-			now.memory[now.cores[core_index].pc + 2]
+			now.memory[vm_mirrored(now.cores[core_index].pc + 1)],
+			now.memory[vm_mirrored(now.cores[core_index].pc + 2)]
 		);
 		getchar();
 
-		vm_step(&now, core_index);
+		vm_run_result result = vm_run(&now, core_index, 1, NULL);
+		scheduler_used(&scheduler, 1);
 		show_delta(&prev, &now);
 		copy_vm_state(&prev, &now);
 
-		if (now.cores[core_index].fault != vm_fault_none) {
-			printf("Machine core %u faulted with fault %u (%s) at pc=%04x.\n", core_index, now.cores[core_index].fault, vm_fault_name(now.cores[core_index].fault), now.cores[core_index].pc);
+		if (result == vm_run_faulted) {
+			printf("Machine core %d faulted with fault %u (%s) at pc=%04x.\n", core_index, now.cores[core_index].fault, vm_fault_name(now.cores[core_index].fault), now.cores[core_index].pc);
 			return now.cores[core_index].fault;
 		}
-
-		core_index += rand();
-		core_index %= core_count;
 	}
 
 	if (state.wrote_to_shut_down)
@@ -0,0 +1,24 @@
+; A benchmark of ordinary code that writes a lot, see bench.sh: one core
+; stores a byte and two bytes every few instructions, so it shows what
+; run spends on each write (the decode cache, compiled code and idle
+; parking all look at writes).
+%power-port( #ff )
+	lib r3 #40 sib r3 #00
+	lib r2 64
+@outer:
+	lib r4 #ff sib r4 #ff
+@inner:
+	wab r3 r4
+	wad r3 r4
+	dec r9 r4 1
+	snz r4
+	bia abs@next
+	bia abs@inner
+@next:
+	dec r9 r2 1
+	snz r2
+	bia abs@done
+	bia abs@outer
+
+@done:
+	portw r0 %power-port
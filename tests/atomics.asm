@@ -0,0 +1,80 @@
+; Every core adds one to four counters %rounds times: with fetchadd16, with
+; fetchadd (a byte), with a cas16 retry loop, and with a plain read and
+; write under a lock taken with xchg16 and fences. The last core to finish
+; checks that each counter got exactly ncores * %rounds, and faults if one
+; is off.
+%power( #ff )
+%rounds( 200 )
+	lib r1 #20 sib r1 #00  ; fetchadd16 counter
+	lib r2 #20 sib r2 #02  ; cas16 counter
+	lib r3 #20 sib r3 #04  ; counter behind the lock
+	lib r4 #20 sib r4 #06  ; the lock
+	lib r13 #20 sib r13 #08 ; fetchadd counter
+	lib r5 1
+	lib r6 %rounds
+@round:
+	fetchadd16 r7 r1 r5
+	fetchadd r7 r13 r5
+
+@cas:
+	rad r7 r2
+	add r9 r8 r7 r5
+	cas16 r10 r2 r7 r8
+	eq r11 r12 r10 r7
+	snz r11
+	bia abs@cas
+
+@lock:
+	xchg16 r7 r4 r5
+	sz r7
+	bia abs@lock
+	fenceacq
+	rad r7 r3
+	inc r9 r7 1
+	wad r3 r7
+	fencerel
+	lib r7 0
+	wad r4 r7
+
+	dec r9 r6 1
+	snz r6
+	bia abs@done
+	bia abs@round
+
+@done:
+	lib r6 #20 sib r6 #0a ; how many cores are done
+	fetchadd16 r8 r6 r5
+	ncores r10
+	dec r9 r10 1
+	eq r11 r12 r8 r10
+	sz r11
+	bia abs@last
+@idle:
+	bia abs@idle
+
+@last:
+	ncores r10
+	lib r7 %rounds
+	umul r9 r8 r10 r7
+	rad r7 r1
+	eq r11 r12 r7 r8
+	snz r11
+	fault
+	rad r7 r2
+	eq r11 r12 r7 r8
+	snz r11
+	fault
+	rad r7 r3
+	eq r11 r12 r7 r8
+	snz r11
+	fault
+	; the byte counter has the low byte of that
+	lib r10 #20 sib r10 #0c
+	wad r10 r8
+	rab r8 r10
+	rab r7 r13
+	eq r11 r12 r7 r8
+	snz r11
+	fault
+
+	portw r0 %power
@@ -0,0 +1,129 @@
+; popcnt, clz, ctz, bswap, bts and btc, at the edges (no bits, every bit, the
+; top and bottom bit) and in between. Core 0 checks every result and faults
+; on the first one that is off, the other cores wait.
+%power( #ff )
+	core r1
+	sz r1
+	bia abs@idle
+
+	; popcnt
+	lib r2 #f0 sib r2 #f1
+	popcnt r6 r2
+	lib r10 9
+	eq r11 r12 r6 r10
+	snz r11
+	fault
+	lib r2 0
+	popcnt r6 r2
+	eq r11 r12 r6 r2
+	snz r11
+	fault
+	lib r2 #ff sib r2 #ff
+	popcnt r6 r2
+	lib r10 16
+	eq r11 r12 r6 r10
+	snz r11
+	fault
+
+	; clz
+	lib r2 1
+	clz r6 r2
+	lib r10 15
+	eq r11 r12 r6 r10
+	snz r11
+	fault
+	lib r2 0
+	clz r6 r2
+	lib r10 16
+	eq r11 r12 r6 r10
+	snz r11
+	fault
+	lib r2 #80 sib r2 #00
+	clz r6 r2
+	lib r10 0
+	eq r11 r12 r6 r10
+	snz r11
+	fault
+	lib r2 #ff
+	clz r6 r2
+	lib r10 8
+	eq r11 r12 r6 r10
+	snz r11
+	fault
+
+	; ctz
+	lib r2 #80 sib r2 #00
+	ctz r6 r2
+	lib r10 15
+	eq r11 r12 r6 r10
+	snz r11
+	fault
+	lib r2 0
+	ctz r6 r2
+	lib r10 16
+	eq r11 r12 r6 r10
+	snz r11
+	fault
+	lib r2 1
+	ctz r6 r2
+	lib r10 0
+	eq r11 r12 r6 r10
+	snz r11
+	fault
+	lib r2 #01 sib r2 #00
+	ctz r6 r2
+	lib r10 8
+	eq r11 r12 r6 r10
+	snz r11
+	fault
+
+	; bswap
+	lib r2 #12 sib r2 #34
+	bswap r6 r2
+	lib r10 #34 sib r10 #12
+	eq r11 r12 r6 r10
+	snz r11
+	fault
+
+	; bit 17 is bit 1, setting it reports it clear the first time and set
+	; the second
+	lib r2 0
+	lib r3 17
+	bts r6 r2 r3
+	lib r10 0
+	eq r11 r12 r6 r10
+	snz r11
+	fault
+	lib r10 2
+	eq r11 r12 r2 r10
+	snz r11
+	fault
+	bts r6 r2 r3
+	lib r10 1
+	eq r11 r12 r6 r10
+	snz r11
+	fault
+	lib r10 2
+	eq r11 r12 r2 r10
+	snz r11
+	fault
+
+	; and clearing it the other way around
+	lib r3 1
+	btc r6 r2 r3
+	lib r10 1
+	eq r11 r12 r6 r10
+	snz r11
+	fault
+	lib r10 0
+	eq r11 r12 r2 r10
+	snz r11
+	fault
+	btc r6 r2 r3
+	eq r11 r12 r6 r10
+	snz r11
+	fault
+
+	portw r0 %power
+@idle:
+	bia abs@idle
@@ -0,0 +1,112 @@
+; mfill, mscan, mcmp and mcopy, with a copy onto itself shifted by a byte
+; and ranges that wrap around the end of memory. Core 0 checks every result
+; and faults on the first one that is off, the other cores wait.
+%power( #ff )
+	core r1
+	sz r1
+	bia abs@idle
+	lib r7 0
+
+	; a is all #aa and b all #bb
+	lib r2 #20 sib r2 #00
+	lib r3 #20 sib r3 #10
+	lib r4 16
+	lib r5 #aa
+	mfill r2 r5 r4
+	lib r5 #bb
+	mfill r3 r5 r4
+
+	; #aa comes first in a, #bb is nowhere in it
+	lib r5 #aa
+	mscan r6 r2 r5 r4
+	eq r11 r12 r6 r7
+	snz r11
+	fault
+	lib r5 #bb
+	mscan r6 r2 r5 r4
+	eq r11 r12 r6 r4
+	snz r11
+	fault
+
+	; a and b differ from the start, after copying a over b they don't
+	mcmp r6 r2 r3 r4
+	eq r11 r12 r6 r7
+	snz r11
+	fault
+	mcopy r3 r2 r4
+	mcmp r6 r2 r3 r4
+	eq r11 r12 r6 r4
+	snz r11
+	fault
+
+	; then b differs again halfway
+	copy r8 r3
+	inc r9 r8 8
+	wab r8 r5
+	mcmp r6 r2 r3 r4
+	lib r10 8
+	eq r11 r12 r6 r10
+	snz r11
+	fault
+
+	; 01 02 03 copied one byte up over itself is 01 01 02 03
+	lib r2 #20 sib r2 #30
+	lib r5 #02 sib r5 #01
+	wad r2 r5
+	copy r8 r2
+	inc r9 r8 2
+	lib r5 3
+	wab r8 r5
+	copy r8 r2
+	inc r9 r8 1
+	lib r4 3
+	mcopy r8 r2 r4
+	rad r6 r2
+	lib r10 #01 sib r10 #01
+	eq r11 r12 r6 r10
+	snz r11
+	fault
+	inc r9 r8 1
+	rad r6 r8
+	lib r10 #03 sib r10 #02
+	eq r11 r12 r6 r10
+	snz r11
+	fault
+
+	; four bytes of #cc from #fffe run on to #0000 and #0001
+	lib r2 #ff sib r2 #fe
+	lib r4 4
+	lib r5 #cc
+	mfill r2 r5 r4
+	lib r8 1
+	rab r6 r8
+	eq r11 r12 r6 r5
+	snz r11
+	fault
+	; scanning from #fff0 finds them 14 bytes in
+	lib r8 #ff sib r8 #f0
+	lib r10 32
+	mscan r6 r8 r5 r10
+	lib r10 14
+	eq r11 r12 r6 r10
+	snz r11
+	fault
+	; they compare equal to four #cc in one piece, and copy back out whole
+	lib r3 #20 sib r3 #40
+	mfill r3 r5 r4
+	mcmp r6 r2 r3 r4
+	eq r11 r12 r6 r4
+	snz r11
+	fault
+	lib r3 #20 sib r3 #50
+	mcopy r3 r2 r4
+	inc r9 r3 2
+	rad r6 r3
+	lib r10 #cc sib r10 #cc
+	eq r11 r12 r6 r10
+	snz r11
+	fault
+
+	portw r0 %power
+@idle:
+	bia abs@idle
@@ -0,0 +1,49 @@
+; Counts to %count in a word on the first page and in one on a later page,
+; checking both start at zero and end at exactly %count. The pool runs forks
+; of one machine with their memory copied on write, so a write leaking from
+; one fork into another shows up as a count that didn't start at zero or
+; went past %count. The other cores wait.
+%power( #ff )
+%count( 250 )
+	core r1
+	sz r1
+	bia abs@idle
+
+	lib r2 #0f sib r2 #f0 ; the word on the first page
+	lib r3 #80 sib r3 #00 ; the word on a later page
+	rad r7 r2
+	snz r7
+	bia abs@fresh
+	fault
+@fresh:
+	rad r7 r3
+	snz r7
+	bia abs@count
+	fault
+
+@count:
+	lib r6 %count
+@again:
+	rad r7 r2
+	inc r9 r7 1
+	wad r2 r7
+	rad r7 r3
+	inc r9 r7 1
+	wad r3 r7
+	dec r9 r6 1
+	sz r6
+	bia abs@again
+
+	lib r8 %count
+	rad r7 r2
+	eq r11 r12 r7 r8
+	snz r11
+	fault
+	rad r7 r3
+	eq r11 r12 r7 r8
+	snz r11
+	fault
+	portw r0 %power
+
+@idle:
+	bia abs@idle
@@ -0,0 +1,124 @@
+; The 32 bit register pair instructions: add32 and sub32 carrying between
+; the halves, shl32 and slr32 across them (and by more than 31), ucmp32 and
+; scmp32 where sign matters, and raq/waq, also wrapping around the end of
+; memory. Core 0 checks every result and faults on the first one that is
+; off, the other cores wait.
+%power( #ff )
+	core r1
+	sz r1
+	bia abs@idle
+
+	; #0000ffff + 1 = #00010000
+	lib r2 0
+	lib r3 #ff sib r3 #ff
+	lib r4 0
+	lib r5 1
+	add32 r2 r3 r4 r5
+	lib r10 1
+	eq r11 r12 r2 r10
+	snz r11
+	fault
+	lib r10 0
+	eq r11 r12 r3 r10
+	snz r11
+	fault
+	; and back
+	sub32 r2 r3 r4 r5
+	lib r10 0
+	eq r11 r12 r2 r10
+	snz r11
+	fault
+	lib r10 #ff sib r10 #ff
+	eq r11 r12 r3 r10
+	snz r11
+	fault
+
+	; 1 << 20 = #00100000, 1 << 36 is 1 << 4
+	lib r2 0
+	lib r3 1
+	lib r4 20
+	shl32 r2 r3 r4
+	lib r10 #10
+	eq r11 r12 r2 r10
+	snz r11
+	fault
+	lib r10 0
+	eq r11 r12 r3 r10
+	snz r11
+	fault
+	lib r4 19
+	slr32 r2 r3 r4
+	lib r10 0
+	eq r11 r12 r2 r10
+	snz r11
+	fault
+	lib r10 2
+	eq r11 r12 r3 r10
+	snz r11
+	fault
+	lib r4 36
+	shl32 r2 r3 r4
+	lib r10 #20
+	eq r11 r12 r3 r10
+	snz r11
+	fault
+
+	; #80000000 is above #00000001 unsigned and below it signed
+	lib r2 #80 sib r2 #00
+	lib r3 0
+	lib r4 0
+	lib r5 1
+	ucmp32 r2 r3 r4 r5
+	lib r10 0
+	eq r11 r12 r2 r10
+	snz r11
+	fault
+	lib r2 #80 sib r2 #00
+	lib r3 0
+	scmp32 r2 r3 r4 r5
+	lib r10 1
+	eq r11 r12 r2 r10
+	snz r11
+	fault
+	eq r11 r12 r3 r4
+	snz r11
+	fault
+
+	; #12345678 goes to memory low half first
+	lib r2 #12 sib r2 #34
+	lib r3 #56 sib r3 #78
+	lib r8 #20 sib r8 #00
+	waq r8 r2 r3
+	rad r6 r8
+	eq r11 r12 r6 r3
+	snz r11
+	fault
+	raq r6 r7 r8
+	eq r11 r12 r6 r2
+	snz r11
+	fault
+	eq r11 r12 r7 r3
+	snz r11
+	fault
+
+	; at #fffe its high half lands on #0000
+	lib r8 #ff sib r8 #fe
+	waq r8 r2 r3
+	lib r9 0
+	rad r6 r9
+	eq r11 r12 r6 r2
+	snz r11
+	fault
+	lib r6 0
+	lib r7 0
+	raq r6 r7 r8
+	eq r11 r12 r6 r2
+	snz r11
+	fault
+	eq r11 r12 r7 r3
+	snz r11
+	fault
+
+	portw r0 %power
+@idle:
+	bia abs@idle
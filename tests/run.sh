@@ -0,0 +1,37 @@
+#!/usr/bin/env sh
+
+# Runs each test program in this directory (or the ones given) every way
+# the vm has of running code: run's interpreter, run -j, a translation by
+# aot, and forked machines on pool. The programs check their own results and
+# fault on the first one that is off, so a test passes when every machine
+# shuts down without a fault. Build assemble, run, aot and pool with
+# make-tool.sh first. Extra flags for run can go in RUN_FLAGS.
+
+set -e
+
+cd "$(dirname "$0")"
+mkdir -p build
+
+failed=0
+check () {
+	if "$@" > build/output 2>&1; then return 0; fi
+	echo "$name failed: $*"
+	cat build/output
+	failed=1
+	return 1
+}
+
+for test in ${*:-*.asm}; do
+	name=$(basename "$test" .asm)
+	../assemble "$name.asm" "build/$name.bin" "build/$name.lab" > /dev/null
+	../aot "build/$name.bin" "build/$name.c" "build/$name.lab" > /dev/null
+	cc -O1 -std=c11 -I.. ../vm.c ../common_ports.c ../host.c ../sv.c "build/$name.c" -o "build/$name"
+
+	check ../run $RUN_FLAGS -c 4 -t 2 "build/$name.bin" \
+		&& check ../run $RUN_FLAGS -j -c 4 -t 2 "build/$name.bin" \
+		&& check "build/$name" $RUN_FLAGS -c 4 -t 2 \
+		&& check ../pool -t 2 -c 4 -r 4 -q 16 "build/$name.bin" \
+		&& echo "$name ok"
+done
+
+exit $failed
@@ -0,0 +1,56 @@
+; Core 0 and core 1 hand a turn byte back and forth %rounds times, each
+; parking until the other notifies it: core 0 with wait8, core 1 with
+; wait16. Core 1 counts its turns, and once core 0 has had all of its own it
+; checks that core 1 had as many, faulting if not. The other cores wait.
+%power( #ff )
+%rounds( 50 )
+	lib r2 #20 sib r2 #00 ; whose turn it is, 0 for core 0 and 1 for core 1
+	lib r3 #20 sib r3 #02 ; how many turns core 1 had
+	core r1
+	sz r1
+	bia abs@not-core-0
+
+	lib r6 %rounds
+	lib r5 1
+@ping:
+	wab r2 r5
+	notify r2
+@ping-wait:
+	wait8 r2 r5
+	rab r7 r2
+	sz r7
+	bia abs@ping-wait
+	fenceacq
+	dec r9 r6 1
+	snz r6
+	bia abs@done
+	bia abs@ping
+
+@done:
+	rad r7 r3
+	lib r8 %rounds
+	eq r11 r12 r7 r8
+	snz r11
+	fault
+	portw r0 %power
+
+@not-core-0:
+	dec r9 r1 1
+	snz r1
+	bia abs@pong
+@idle:
+	bia abs@idle
+
+@pong:
+	lib r5 0
+	wait16 r2 r5
+	rad r7 r2
+	snz r7
+	bia abs@pong
+	rad r8 r3
+	inc r9 r8 1
+	wad r3 r8
+	fencerel
+	wab r2 r5
+	notify r2
+	bia abs@pong
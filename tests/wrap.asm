@@ -0,0 +1,91 @@
+; Memory wraps around at the end: a two-byte read or write at #ffff has its
+; high byte at #0000, and an instruction at #fffe takes its last byte from
+; #0000. Core 0 checks reads and writes across the end, then builds a bia at
+; #fffe whose target's low byte is the opcode of the bia at #0000, and only
+; gets back through the landing bia written there. Missing it slides through
+; zeroed memory (nops) into a fault put before the landing or around to the
+; start, which faults once core 0 has jumped. The other cores check in first, since core 0 rewrites the byte
+; they started on, then wait.
+%power( #ff )
+	bia abs@start
+@start:
+	lib r2 #20 sib r2 #00 ; cores that ran the first instruction
+	lib r14 #20 sib r14 #02 ; set once core 0 jumped to #fffe
+	rab r7 r14
+	sz r7
+	fault
+	lib r5 1
+	fetchadd16 r7 r2 r5
+	core r1
+	sz r1
+	bia abs@idle
+	ncores r3
+@wait:
+	rad r7 r2
+	eq r11 r12 r7 r3
+	snz r11
+	bia abs@wait
+
+	lib r4 #ff sib r4 #ff ; the last byte
+	lib r10 0
+	lib r13 #01 sib r13 #00
+	rab r6 r10 ; the opcode of bia
+	umul r9 r8 r6 r13
+	rad r7 r4
+	eq r11 r12 r7 r8
+	snz r11
+	fault
+
+	lib r7 #3c sib r7 #5c
+	wad r4 r7
+	rab r8 r4
+	lib r9 #5c
+	eq r11 r12 r8 r9
+	snz r11
+	fault
+	rab r8 r10
+	lib r9 #3c
+	eq r11 r12 r8 r9
+	snz r11
+	fault
+	rad r8 r4
+	eq r11 r12 r8 r7
+	snz r11
+	fault
+
+	; bia #c0xx at #fffe, where xx comes from #0000 again
+	umul r9 r8 r6 r13
+	lib r7 #c0
+	add r9 r12 r8 r7
+	wad r4 r12
+	dec r9 r4 1
+	wab r4 r6
+	; bia abs@back at #c0xx, after a fault so sliding into it doesn't count
+	lib r7 #c0 sib r7 #00
+	add r9 r8 r7 r6
+	dec r9 r8 3
+	lib r7 abshi@missed sib r7 abslo@missed
+	rad r9 r7
+	wad r8 r9
+	inc r9 r7 2
+	inc r9 r8 2
+	rab r9 r7
+	wab r8 r9
+	inc r9 r8 1
+	wab r8 r6
+	inc r9 r8 1
+	lib r7 abshi@back
+	wab r8 r7
+	inc r9 r8 1
+	lib r7 abslo@back
+	wab r8 r7
+	wab r14 r5
+	ba r4
+@missed:
+	fault
+
+@back:
+	portw r0 %power
+
+@idle:
+	bia abs@idle
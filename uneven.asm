@@ -0,0 +1,48 @@
+; Uneven work for bench.sh to watch cores move between host threads: core n
+; adds one to a shared total (n + 1) * 256 times. A core run by two threads
+; at once, or run again from an older state, adds more than its share, so
+; the last core to finish checks the total and faults if it is off.
+%power-port( #ff )
+	core r1
+	lib r2 #10 sib r2 #00 ; the total
+	lib r3 1
+
+	copy r4 r1
+	inc r9 r4 1
+	lib r5 #01 sib r5 #00
+	umul r9 r4 r4 r5
+@work:
+	fetchadd16 r6 r2 r3
+	dec r9 r4 1
+	snz r4
+	bia abs@done
+	bia abs@work
+
+@done:
+	lib r6 #10 sib r6 #02 ; how many cores are done
+	fetchadd16 r8 r6 r3
+	ncores r10
+	dec r9 r10 1
+	eq r11 r12 r8 r10
+	sz r11
+	bia abs@last
+@finished:
+	bia abs@finished
+
+@last:
+	; every core n added (n + 1) * 256, counting down from ncores
+	ncores r10
+	lib r7 0
+@expect:
+	umul r9 r4 r10 r5
+	add r9 r7 r7 r4
+	dec r9 r10 1
+	snz r10
+	bia abs@check
+	bia abs@expect
+@check:
+	rad r4 r2
+	eq r11 r12 r4 r7
+	snz r11
+	fault
+	portw r0 %power-port
@@ -1,38 +1,634 @@
+// memfd_create for the JIT's code arena
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdatomic.h>
 #include <stdbool.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include "host.h"
 #include "ops.h"
 #include "vm.h"
 
-static void vm_push(vm_state *vm, uint8_t core_index, uint16_t value) {
-	vm->cores[core_index].registers[15] += 2;
-	uint16_t cursor = vm->cores[core_index].registers[15]; 
-	vm->memory[cursor + 1] = value >> 8;
-	vm->memory[cursor] = value & 0xff;
+// An instruction with its operands already pulled apart, so that code which
+// runs more than once only pays for decoding the first time.
+typedef struct vm_decoded {
+	uint8_t handler; // a vm_op, or one of the vm_handler_* below
+	uint8_t r1, r2, r3, r4;
+	uint8_t b2;
+	uint16_t d;
+} vm_decoded;
+
+_Static_assert(sizeof(vm_decoded) == sizeof(uint64_t), "vm_decoded should pack into a cache slot");
+
+enum {
+	vm_handler_illegal = vm_op_count,
+	vm_handler_first_fused, // followed by one handler per vm_fusion
+	vm_handler_count = vm_handler_first_fused + vm_fusion_count,
+	vm_handler_undecoded = 0xff, // only found in empty cache slots
+};
+
+_Static_assert(vm_handler_count <= vm_handler_undecoded, "too many handlers to fit in vm_decoded.handler");
+
+// how many bytes of memory, starting at its pc, a decoded slot depends on
+#define VM_DECODE_SPAN (3 * VM_MAX_FUSION_LENGTH)
+
+struct vm_decode_cache {
+	// one packed vm_decoded per pc, shared by every core
+	_Atomic uint64_t slots[0x10000];
+
+	// whether any slot in each 256 byte region has been filled, lets writes
+	// to plain data skip the invalidation work
+	_Atomic bool region_used[0x100];
+	// bumped before slots in the region are emptied, see vm_fetch_cached
+	_Atomic uint32_t region_generation[0x100];
+};
+
+static vm_decoded vm_decode(vm_state const *vm, uint16_t pc) {
+	// other cores may be writing the instruction, so it is loaded like
+	// data, wrapping around at the end of memory
+	uint8_t const op = vm_load_byte(vm, pc);
+	uint8_t const b = vm_load_byte(vm, pc + 1);
+	uint8_t const c = vm_load_byte(vm, pc + 2);
+
+	return (vm_decoded){
+		.handler = op < vm_op_count ? op : vm_handler_illegal,
+		.r1 = b >> 4,
+		.r2 = b & 0x0f,
+		.r3 = c >> 4,
+		.r4 = c & 0x0f,
+		.b2 = c,
+		.d = (b << 8) | c,
+	};
 }
 
-static uint16_t vm_pop(vm_state *vm, uint8_t core_index) {
-	uint16_t cursor = vm->cores[core_index].registers[15];
-	uint16_t result = (vm->memory[cursor + 1] << 8) | vm->memory[cursor];
-	vm->cores[core_index].registers[15] -= 2;
+static struct {
+	uint8_t length;
+	uint8_t ops[VM_MAX_FUSION_LENGTH];
+} const vm_fusion_table[] = {
+#define X(name, length, first, second, third) [vm_fusion_##name] = { length, { vm_op_##first, vm_op_##second, vm_op_##third } },
+	vm_x_fusions(X)
+#undef X
+};
+
+// fills in the operands of a fused instruction from its parts, returns false
+// when the parts don't meet the fusion's conditions
+static bool vm_fused_operands(vm_fusion fusion, vm_decoded const parts[VM_MAX_FUSION_LENGTH], vm_decoded *result) {
+	switch (fusion) {
+	case vm_fusion_Load_Immediate_Double:
+		if (parts[0].r1 != parts[1].r1) return false;
+		*result = (vm_decoded){ .r1 = parts[0].r1, .d = (parts[0].b2 << 8) | parts[1].b2 };
+		return true;
+
+	case vm_fusion_Branch_If_Non_Zero:
+	case vm_fusion_Branch_If_Zero:
+		*result = (vm_decoded){ .r1 = parts[0].r1, .d = parts[1].d };
+		return true;
+
+	case vm_fusion_Read_Branch_If_Non_Zero:
+	case vm_fusion_Read_Branch_If_Zero:
+		*result = (vm_decoded){ .r1 = parts[0].r1, .r2 = parts[0].r2, .r3 = parts[1].r1, .d = parts[2].d };
+		return true;
+	}
+
+	return false;
+}
 
+// decodes the instruction at pc, fusing it with the following ones when
+// they form one of the sequences in vm_x_fusions. The instructions after it
+// are only decoded for fusions that start with it.
+static vm_decoded vm_decode_fused(vm_state const *vm, uint16_t pc) {
+	vm_decoded parts[VM_MAX_FUSION_LENGTH];
+	parts[0] = vm_decode(vm, pc);
+	uint8_t decoded = 1;
+
+	for (uint8_t fusion = 0; fusion < vm_fusion_count; ++fusion) {
+		if (parts[0].handler != vm_fusion_table[fusion].ops[0]) continue;
+		bool matches = true;
+		for (uint8_t i = 1; i < vm_fusion_table[fusion].length && matches; ++i) {
+			if (i == decoded)
+				parts[decoded++] = vm_decode(vm, pc + 3 * i);
+			matches = parts[i].handler == vm_fusion_table[fusion].ops[i];
+		}
+
+		vm_decoded fused;
+		if (matches && vm_fused_operands(fusion, parts, &fused)) {
+			fused.handler = vm_handler_first_fused + fusion;
+			return fused;
+		}
+	}
+
+	return parts[0];
+}
+
+static inline vm_decoded vm_fetch_cached(vm_state const *vm, vm_decode_cache *cache, uint16_t pc) {
+	uint64_t const undecoded = atomic_load_explicit(&cache->slots[pc], memory_order_relaxed);
+	vm_decoded result;
+	memcpy(&result, &undecoded, sizeof result);
+	if (result.handler != vm_handler_undecoded)
+		return result;
+
+	// Writes skip regions that aren't used yet. A region is only marked
+	// once, so that side pays with host_fence_other_threads: a write racing
+	// with it either sees the mark or is seen by the decode below.
+	uint8_t const region = pc >> 8;
+	if (!atomic_load_explicit(&cache->region_used[region], memory_order_relaxed)) {
+		atomic_store_explicit(&cache->region_used[region], true, memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+		host_fence_other_threads();
+	}
+
+	// An invalidation between decoding and filling the slot would leave the
+	// old instruction there for good. It bumps the generation before it
+	// empties the slot, so when that moved the slot is emptied again.
+	uint32_t const generation = atomic_load_explicit(&cache->region_generation[region], memory_order_acquire);
+	result = vm_decode_fused(vm, pc);
+	uint64_t decoded, expected = undecoded;
+	memcpy(&decoded, &result, sizeof decoded);
+	if (atomic_compare_exchange_strong_explicit(&cache->slots[pc], &expected, decoded, memory_order_acquire, memory_order_relaxed)
+		&& atomic_load_explicit(&cache->region_generation[region], memory_order_relaxed) != generation)
+		atomic_compare_exchange_strong_explicit(&cache->slots[pc], &decoded, undecoded, memory_order_relaxed, memory_order_relaxed);
 	return result;
 }
 
-void vm_init(vm_state *vm, uint8_t core_count, vm_core *cores) {
+static uint64_t vm_undecoded_slot(void) {
+	vm_decoded empty = { .handler = vm_handler_undecoded };
+	uint64_t packed;
+	memcpy(&packed, &empty, sizeof packed);
+	return packed;
+}
+
+static void vm_invalidate_slots(vm_decode_cache *cache, uint16_t first, uint32_t count) {
+	uint64_t const empty = vm_undecoded_slot();
+	int32_t bumped = -1; // the region whose generation was bumped last
+	for (uint32_t i = 0; i < count; ++i) {
+		uint16_t pc = first + i;
+		if (!atomic_load_explicit(&cache->region_used[pc >> 8], memory_order_relaxed)) continue;
+		// before the slot is emptied, a fill racing with us sees the bump
+		// through it and empties the slot again
+		if (pc >> 8 != bumped) {
+			bumped = pc >> 8;
+			atomic_fetch_add_explicit(&cache->region_generation[bumped], 1, memory_order_release);
+		}
+		atomic_store_explicit(&cache->slots[pc], empty, memory_order_release);
+	}
+}
+
+// must be called for every write to guest memory while the cache is enabled
+static inline void vm_decode_cache_note_write(vm_decode_cache *cache, uint16_t address, uint16_t length) {
+	if (!cache) return;
+
+	// any slot starting up to VM_DECODE_SPAN - 1 bytes before the write may
+	// have decoded the old bytes
+	uint16_t const first = address - (VM_DECODE_SPAN - 1);
+	uint16_t const last = address + length - 1;
+	if (atomic_load_explicit(&cache->region_used[first >> 8], memory_order_relaxed)
+		|| atomic_load_explicit(&cache->region_used[last >> 8], memory_order_relaxed))
+		vm_invalidate_slots(cache, first, (uint32_t)length + VM_DECODE_SPAN - 1);
+}
+
+bool vm_enable_decode_cache(vm_state *vm) {
+	if (vm->decode_cache) return true;
+
+	vm_decode_cache *cache = malloc(sizeof *cache);
+	if (!cache) return false;
+
+	uint64_t const empty = vm_undecoded_slot();
+	for (uint32_t i = 0; i < 0x10000; ++i)
+		atomic_init(&cache->slots[i], empty);
+	for (uint32_t i = 0; i < 0x100; ++i) {
+		atomic_init(&cache->region_used[i], false);
+		atomic_init(&cache->region_generation[i], 0);
+	}
+
+	vm->decode_cache = cache;
+	return true;
+}
+
+void vm_disable_decode_cache(vm_state *vm) {
+	free(vm->decode_cache);
+	vm->decode_cache = NULL;
+	for (uint8_t i = 0; i < vm_fusion_count; ++i)
+		atomic_init(&vm->fusions_fired[i], 0);
+}
+
+// little endian, wrapping around at the end of memory, the caller notes
+// the write
+static uint32_t vm_read_four_byte(vm_state const *vm, uint16_t address) {
+	return (uint32_t)vm_load_two_byte(vm, address + 2) << 16 | vm_load_two_byte(vm, address);
+}
+
+static void vm_write_four_byte(vm_state *vm, uint16_t address, uint32_t value) {
+	vm_store_two_byte(vm, address, value & 0xffff);
+	vm_store_two_byte(vm, address + 2, value >> 16);
+}
+
+// Idle loop detection, see vm_idle_arrived for how loops are found. A loop
+// is only parked once running it on the side shows it really is idle.
+#define VM_IDLE_MAX_STEPS 8 // the longest loop that is checked
+
+static bool vm_unpark_idle(vm_state *vm, vm_core *core) {
+	uint8_t idle = vm_park_idle;
+	if (!atomic_compare_exchange_strong_explicit(&core->parked, &idle, vm_park_none, memory_order_acq_rel, memory_order_relaxed))
+		return false;
+	for (uint8_t i = 0; i < core->idle_watch_count; ++i) {
+		uint16_t const address = atomic_load_explicit(&core->idle_watch[i], memory_order_relaxed);
+		atomic_fetch_sub_explicit(&vm->idle_watchers[address >> 8], 1, memory_order_relaxed);
+	}
+	atomic_fetch_sub_explicit(&vm->idle_parked, 1, memory_order_relaxed);
+	return true;
+}
+
+static void vm_wake_idle(vm_state *vm, uint16_t address, uint16_t length) {
+	bool woke = false;
+	for (uint16_t i = 0; i < vm->core_count; ++i) {
+		vm_core *core = &vm->cores[i];
+		if (atomic_load_explicit(&core->parked, memory_order_acquire) != vm_park_idle) continue;
+		for (uint8_t w = 0; w < core->idle_watch_count; ++w) {
+			if ((uint16_t)(atomic_load_explicit(&core->idle_watch[w], memory_order_relaxed) - address) >= length) continue;
+			woke |= vm_unpark_idle(vm, core);
+			break;
+		}
+	}
+
+	if (!woke) return;
+	atomic_fetch_add_explicit(&vm->wakes, 1, memory_order_release);
+	if (vm->on_wake)
+		vm->on_wake(vm);
+}
+
+// must be called for every write to guest memory, like vm_note_write (the
+// JIT calls it separately)
+static inline void vm_idle_note_write(vm_state *vm, uint16_t address, uint16_t length) {
+	// The write has to come before looking for watchers so that a core
+	// parking at the same time either sees it or is seen here. Parking pays
+	// for that with host_fence_other_threads, writes only keep the compiler
+	// from swapping the two. Nothing is parked without idle_parking.
+	atomic_signal_fence(memory_order_seq_cst);
+	if (!atomic_load_explicit(&vm->idle_parked, memory_order_relaxed)) return;
+	uint16_t const last = address + length - 1;
+	if (atomic_load_explicit(&vm->idle_watchers[address >> 8], memory_order_relaxed)
+		|| atomic_load_explicit(&vm->idle_watchers[last >> 8], memory_order_relaxed))
+		vm_wake_idle(vm, address, length);
+}
+
+typedef struct vm_idle_reads {
+	uint8_t count;
+	uint16_t addresses[VM_IDLE_MAX_READS];
+	uint8_t values[VM_IDLE_MAX_READS];
+} vm_idle_reads;
+
+static bool vm_idle_read(vm_state const *vm, vm_idle_reads *reads, uint16_t address, uint8_t *value) {
+	*value = vm_load_byte(vm, address);
+	for (uint8_t i = 0; i < reads->count; ++i)
+		if (reads->addresses[i] == address)
+			return reads->values[i] == *value;
+	if (reads->count == VM_IDLE_MAX_READS)
+		return false;
+	reads->addresses[reads->count] = address;
+	reads->values[reads->count] = *value;
+	++reads->count;
+	return true;
+}
+
+// Runs the loop at head once on a copy of the registers, only following
+// instructions that can't change anything but registers. The loop is idle
+// if that comes back to head with the same registers, in which case it will
+// keep doing so until one of the bytes it read changes.
+static bool vm_idle_loop(vm_state const *vm, uint16_t head, uint16_t const *registers, vm_idle_reads *reads) {
+	uint16_t r[16];
+	memcpy(r, registers, sizeof r);
+	uint16_t pc = head;
+	reads->count = 0;
+
+	for (uint8_t steps = 0; steps < VM_IDLE_MAX_STEPS; ++steps) {
+		vm_decoded const insn = vm_decode(vm, pc);
+		uint8_t low, high;
+		bool cmp;
+		pc += 3;
+		switch (insn.handler) {
+		case vm_op_Nop:
+		case vm_op_Fence_Acquire: case vm_op_Fence_Release: case vm_op_Fence:
+			break;
+		case vm_op_Load_Immediate_Byte: r[insn.r1] = insn.b2; break;
+		case vm_op_Shift_In_Byte: r[insn.r1] = (r[insn.r1] << 8) | insn.b2; break;
+		case vm_op_Copy: r[insn.r1] = r[insn.r2]; break;
+		case vm_op_Compare_Signed:
+		case vm_op_Compare_Unsigned:
+		case vm_op_Compare_Equal:
+			if (insn.r1 == insn.r2) return false;
+			cmp = insn.handler == vm_op_Compare_Equal ? r[insn.r3] == r[insn.r4]
+				: insn.handler == vm_op_Compare_Unsigned ? r[insn.r3] <= r[insn.r4]
+				: (int8_t)r[insn.r3] <= (int8_t)r[insn.r4];
+			r[insn.r1] = cmp;
+			r[insn.r2] = !cmp;
+			break;
+		case vm_op_Skip_If_Zero:     if (r[insn.r1] == 0) pc += 3; break;
+		case vm_op_Skip_If_Non_Zero: if (r[insn.r1] != 0) pc += 3; break;
+		case vm_op_Branch_Immediate_Absolute: pc = insn.d; break;
+		case vm_op_Branch_Immediate_Relative: pc = pc - 3 + (int16_t)insn.d; break;
+		case vm_op_Read_Address_Byte:
+			if (!vm_idle_read(vm, reads, r[insn.r2], &low)) return false;
+			r[insn.r1] = low;
+			break;
+		case vm_op_Read_Address_Two_Byte:
+			if (!vm_idle_read(vm, reads, r[insn.r2], &low)) return false;
+			if (!vm_idle_read(vm, reads, r[insn.r2] + 1, &high)) return false;
+			r[insn.r1] = high << 8 | low;
+			break;
+		default:
+			return false;
+		}
+		if (pc == head)
+			return memcmp(r, registers, sizeof r) == 0;
+	}
+	return false;
+}
+
+bool vm_idle_park(vm_state *vm, uint16_t core_index, uint16_t head, uint16_t const *registers) {
+	vm_idle_reads reads;
+	if (!vm_idle_loop(vm, head, registers, &reads))
+		return false;
+
+	vm_core *core = &vm->cores[core_index];
+	core->idle_watch_count = reads.count;
+	for (uint8_t i = 0; i < reads.count; ++i) {
+		atomic_store_explicit(&core->idle_watch[i], reads.addresses[i], memory_order_relaxed);
+		atomic_store_explicit(&core->idle_watch_values[i], reads.values[i], memory_order_relaxed);
+		atomic_fetch_add_explicit(&vm->idle_watchers[reads.addresses[i] >> 8], 1, memory_order_relaxed);
+	}
+	atomic_fetch_add_explicit(&vm->idle_parked, 1, memory_order_relaxed);
+	atomic_store_explicit(&core->parked, vm_park_idle, memory_order_release);
+
+	// Like vm_wait, look at memory again after parking so a write we raced
+	// with either wakes us or is seen here. The barrier on the other threads
+	// orders their writes against their look at idle_watchers, without it
+	// a wake up can be missed until vm_recheck_idle comes around.
+	atomic_thread_fence(memory_order_seq_cst);
+	host_fence_other_threads();
+	for (uint8_t i = 0; i < reads.count; ++i) {
+		if (vm_load_byte(vm, reads.addresses[i]) == reads.values[i]) continue;
+		vm_unpark_idle(vm, core);
+		return false;
+	}
+
+	atomic_fetch_add_explicit(&vm->idle_parks, 1, memory_order_relaxed);
+	return true;
+}
+
+bool vm_recheck_idle(vm_state *vm, uint16_t core_index) {
+	vm_core *core = &vm->cores[core_index];
+	uint8_t const parked = atomic_load_explicit(&core->parked, memory_order_acquire);
+	if (parked != vm_park_idle)
+		return parked == vm_park_none;
+
+	for (uint8_t i = 0; i < core->idle_watch_count; ++i) {
+		uint16_t const address = atomic_load_explicit(&core->idle_watch[i], memory_order_relaxed);
+		if (vm_load_byte(vm, address) == atomic_load_explicit(&core->idle_watch_values[i], memory_order_relaxed)) continue;
+		if (vm_unpark_idle(vm, core))
+			atomic_fetch_add_explicit(&vm->wakes, 1, memory_order_release);
+		return true;
+	}
+	return false;
+}
+
+// blocks are at most this many instructions, so vm_run only enters one when
+// at least that much of its budget is left
+#define VM_JIT_MAX_BLOCK_STEPS 64
+
+// set in a block's return value when it stopped after a portw to a port with stop set
+#define VM_JIT_EXIT_STOP 0x80000000u
+
+// Compiled blocks take the registers of the core and return the pc to
+// continue at in the low 16 bits, how many instructions they ran in the
+// next 15 and VM_JIT_EXIT_STOP.
+typedef uint32_t (*vm_jit_block)(uint16_t *registers);
+
+#if VM_HAVE_JIT
+#include "vm_jit.c"
+#else
+bool vm_enable_jit(vm_state *vm) { (void)vm; return false; }
+void vm_disable_jit(vm_state *vm) { (void)vm; }
+uint32_t vm_jit_block_count(vm_state const *vm) { (void)vm; return 0; }
+static bool vm_jit_note_write(vm_jit *jit, uint16_t address, uint16_t length) { (void)jit; (void)address; (void)length; return false; }
+static vm_jit_block vm_jit_block_at(vm_state *vm, vm_jit *jit, uint16_t pc) { (void)vm; (void)jit; (void)pc; return NULL; }
+static void vm_jit_enter(vm_jit *jit) { (void)jit; }
+static void vm_jit_leave(vm_jit *jit) { (void)jit; }
+#endif
+
+// must be called for every write to guest memory done by an instruction
+static inline void vm_note_write(vm_state *vm, uint16_t address, uint16_t length) {
+	vm_decode_cache_note_write(vm->decode_cache, address, length);
+	vm_jit_note_write(vm->jit, address, length);
+	vm_idle_note_write(vm, address, length);
+}
+
+// vm_note_write only checks the regions at either end of a write, so longer
+// writes go through it a region at a time
+static void vm_note_long_write(vm_state *vm, uint16_t address, uint32_t length) {
+	while (length > 0) {
+		uint32_t piece = 0x100 - (address & 0xff);
+		if (piece > length) piece = length;
+		vm_note_write(vm, address, piece);
+		address += piece;
+		length -= piece;
+	}
+}
+
+void vm_invalidate_decoded(vm_state *vm, uint16_t address, uint16_t length) {
+	vm_note_long_write(vm, address, length);
+}
+
+// how many of length bytes starting at address come before memory wraps around
+static inline uint32_t vm_until_wrap(uint16_t address, uint32_t length) {
+	uint32_t const until_end = 0x10000 - address;
+	return length < until_end ? length : until_end;
+}
+
+// Other cores may load and store the same bytes as a bulk memory
+// instruction, so with more than one core they go a relaxed atomic byte at
+// a time like the instructions they stand for (see ops.h). Machines with
+// one core keep the C library's memmove, memset, memcmp and memchr, which
+// are vectorized for the host, only splitting their work where a range
+// wraps around.
+
+void vm_load_bytes(vm_state const *vm, uint16_t address, uint8_t *to, uint16_t length) {
+	if (vm->core_count > 1) {
+		for (uint32_t i = 0; i < length; ++i)
+			to[i] = vm_load_byte(vm, address + i);
+		return;
+	}
+	uint32_t const first = vm_until_wrap(address, length);
+	memcpy(to, &vm->memory[address], first);
+	memcpy(to + first, vm->memory, length - first);
+}
+
+void vm_store_bytes(vm_state *vm, uint16_t address, uint8_t const *from, uint16_t length) {
+	if (vm->core_count > 1) {
+		for (uint32_t i = 0; i < length; ++i)
+			vm_store_byte(vm, address + i, from[i]);
+		return;
+	}
+	uint32_t const first = vm_until_wrap(address, length);
+	memcpy(&vm->memory[address], from, first);
+	memcpy(vm->memory, from + first, length - first);
+}
+
+void vm_memory_copy(vm_state *vm, uint16_t to, uint16_t from, uint16_t length) {
+	if (vm->core_count == 1 && vm_until_wrap(from, length) == length && vm_until_wrap(to, length) == length) {
+		memmove(&vm->memory[to], &vm->memory[from], length);
+	} else {
+		// overlapping ranges that wrap around are hard to get right in
+		// place, so go through a buffer
+		static _Thread_local uint8_t buffer[0x10000];
+		vm_load_bytes(vm, from, buffer, length);
+		vm_store_bytes(vm, to, buffer, length);
+	}
+	vm_note_long_write(vm, to, length);
+}
+
+void vm_memory_fill(vm_state *vm, uint16_t to, uint8_t value, uint16_t length) {
+	if (vm->core_count > 1) {
+		for (uint32_t i = 0; i < length; ++i)
+			vm_store_byte(vm, to + i, value);
+	} else {
+		uint32_t const first = vm_until_wrap(to, length);
+		memset(&vm->memory[to], value, first);
+		memset(vm->memory, value, length - first);
+	}
+	vm_note_long_write(vm, to, length);
+}
+
+uint16_t vm_memory_compare(vm_state const *vm, uint16_t a, uint16_t b, uint16_t length) {
+	if (vm->core_count > 1) {
+		for (uint32_t offset = 0; offset < length; ++offset)
+			if (vm_load_byte(vm, a + offset) != vm_load_byte(vm, b + offset))
+				return offset;
+		return length;
+	}
+
+	uint32_t offset = 0;
+	while (offset < length) {
+		// neither side of a piece wraps around
+		uint16_t const at_a = a + offset, at_b = b + offset;
+		uint32_t const piece = vm_until_wrap(at_b, vm_until_wrap(at_a, length - offset));
+		uint8_t const *pa = &vm->memory[at_a], *pb = &vm->memory[at_b];
+		if (memcmp(pa, pb, piece) != 0) {
+			while (*pa == *pb) { ++pa; ++pb; ++offset; }
+			return offset;
+		}
+		offset += piece;
+	}
+	return length;
+}
+
+uint16_t vm_memory_scan(vm_state const *vm, uint16_t from, uint8_t value, uint16_t length) {
+	if (vm->core_count > 1) {
+		for (uint32_t offset = 0; offset < length; ++offset)
+			if (vm_load_byte(vm, from + offset) == value)
+				return offset;
+		return length;
+	}
+
+	uint32_t const first = vm_until_wrap(from, length);
+	uint8_t const *found = memchr(&vm->memory[from], value, first);
+	if (found) return found - &vm->memory[from];
+	found = memchr(vm->memory, value, length - first);
+	if (found) return first + (found - vm->memory);
+	return length;
+}
+
+static void vm_push(vm_state *vm, uint16_t *sp, uint16_t value) {
+	*sp += 2;
+	uint16_t cursor = *sp;
+	vm_store_two_byte(vm, cursor, value);
+	vm_note_long_write(vm, cursor, 2);
+}
+
+static uint16_t vm_pop(vm_state *vm, uint16_t *sp) {
+	uint16_t cursor = *sp;
+	uint16_t result = vm_load_two_byte(vm, cursor);
+	*sp -= 2;
+
+	return result;
+}
+
+void vm_init(vm_state *vm, uint16_t core_count, vm_core *cores, uint8_t *memory) {
 	vm->core_count = core_count;
 	vm->cores = cores;
-	for (uint16_t i = 0; i < core_count; ++i)
+	vm->memory = memory;
+	for (uint16_t i = 0; i < core_count; ++i) {
 		vm->cores[i].pc = 0;
+		atomic_init(&vm->cores[i].parked, vm_park_none);
+		atomic_init(&vm->cores[i].parked_on, 0);
+		vm->cores[i].idle_watch_count = 0;
+	}
 
-	vm->ports = (vm_ports){
-		.context = NULL,
-		.port_read = NULL,
-		.port_write = NULL,
-	};
+	for (uint16_t i = 0; i < 256; ++i)
+		vm->ports[i] = (vm_port){ .context = NULL, .read = NULL, .write = NULL };
+
+	vm->dispatch = VM_HAVE_THREADED_DISPATCH ? vm_dispatch_threaded : vm_dispatch_switch;
+	vm->decode_cache = NULL;
+	vm->jit = NULL;
+	vm->on_wake = NULL;
+	atomic_init(&vm->waiting, 0);
+	vm->idle_parking = false;
+	atomic_init(&vm->idle_parks, 0);
+	atomic_init(&vm->idle_parked, 0);
+	atomic_init(&vm->wakes, 0);
+	for (uint16_t i = 0; i < 0x100; ++i)
+		atomic_init(&vm->idle_watchers[i], 0);
+	for (uint8_t i = 0; i < vm_fusion_count; ++i)
+		atomic_init(&vm->fusions_fired[i], 0);
+}
+
+bool vm_wait(vm_state *vm, uint16_t core_index, uint16_t address, uint16_t expected, bool two_byte) {
+	vm_core *core = &vm->cores[core_index];
+
+	// park first and look at memory after, so that a notify racing with us
+	// either sees us parked or happened before the store we then see
+	atomic_store_explicit(&core->parked_on, address, memory_order_relaxed);
+	atomic_store_explicit(&core->parked, vm_park_wait, memory_order_relaxed);
+	atomic_fetch_add_explicit(&vm->waiting, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+
+	uint16_t const current = two_byte ? vm_load_two_byte(vm, address) : vm_load_byte(vm, address);
+	if (current == (two_byte ? expected : (uint8_t)expected))
+		return true;
+
+	// unless a notify already woke us
+	uint8_t waiting = vm_park_wait;
+	if (atomic_compare_exchange_strong_explicit(&core->parked, &waiting, vm_park_none, memory_order_relaxed, memory_order_relaxed))
+		atomic_fetch_sub_explicit(&vm->waiting, 1, memory_order_relaxed);
+	return false;
+}
+
+void vm_notify(vm_state *vm, uint16_t address) {
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&vm->waiting, memory_order_relaxed) == 0)
+		return;
+
+	bool woke = false;
+	for (uint16_t i = 0; i < vm->core_count; ++i) {
+		vm_core *core = &vm->cores[i];
+		if (atomic_load_explicit(&core->parked, memory_order_relaxed) != vm_park_wait) continue;
+		if (atomic_load_explicit(&core->parked_on, memory_order_relaxed) != address) continue;
+		// another notify may have got there first
+		uint8_t waiting = vm_park_wait;
+		if (!atomic_compare_exchange_strong_explicit(&core->parked, &waiting, vm_park_none, memory_order_release, memory_order_relaxed)) continue;
+		atomic_fetch_sub_explicit(&vm->waiting, 1, memory_order_relaxed);
+		woke = true;
+	}
+
+	if (!woke) return;
+	atomic_fetch_add_explicit(&vm->wakes, 1, memory_order_release);
+	if (vm->on_wake)
+		vm->on_wake(vm);
+}
+
+void vm_register_port(vm_state *vm, uint8_t port_number, vm_port port) {
+	vm->ports[port_number] = port;
 }
 
 char const *vm_op_name(uint8_t code) {
@@ -56,29 +652,34 @@ vm_operands vm_op_encoding(uint8_t code) {
 #undef X
 }
 
+char const *vm_fusion_name(vm_fusion f) {
+#define X(name, length, first, second, third) case vm_fusion_##name : return #name;
+	switch (f) { vm_x_fusions(X) }
+	return "???";
+#undef X
+}
 
 char const *vm_fault_name(vm_fault f) {
 	switch (f) {
 	case vm_fault_none: return "none";
 	case vm_fault_illegal_instruction: return "illegal instruction";
 	case vm_fault_divide_by_zero: return "divide by zero";
+	case vm_fault_misaligned_atomic: return "misaligned atomic";
 	case vm_fault_explicitly_requested: return "explicitly requested";
 	}
 	return "???";
 }
 
 
-#define CURRENT_CORE (&vm->cores[core_index])
-
 #define R1_id (b >> 4)
 #define R2_id (b & 0x0f)
 #define R3_id (c >> 4)
 #define R4_id (c & 0x0f)
 
-#define R1 (&CURRENT_CORE->registers[R1_id])
-#define R2 (&CURRENT_CORE->registers[R2_id])
-#define R3 (&CURRENT_CORE->registers[R3_id])
-#define R4 (&CURRENT_CORE->registers[R4_id])
+#define R1 (&regs[R1_id])
+#define R2 (&regs[R2_id])
+#define R3 (&regs[R3_id])
+#define R4 (&regs[R4_id])
 
 #define SR1 ((int8_t *)R1)
 #define SR2 ((int8_t *)R2)
@@ -120,11 +721,11 @@ char const *vm_disasm(uint8_t op, uint8_t b, uint8_t c) {
 	return buf;
 }
 
-char const *vm_disasm_pc(vm_state const *vm, uint8_t core_index) {
+char const *vm_disasm_pc(vm_state const *vm, uint16_t core_index) {
 	return vm_disasm(
-		vm->memory[vm->cores[core_index].pc],
-		vm->memory[vm->cores[core_index].pc + 1],
-		vm->memory[vm->cores[core_index].pc + 2]
+		vm_load_byte(vm, vm->cores[core_index].pc),
+		vm_load_byte(vm, vm->cores[core_index].pc + 1),
+		vm_load_byte(vm, vm->cores[core_index].pc + 2)
 	);
 }
 
@@ -152,158 +753,53 @@ char const *vm_padded_reg_name(uint8_t n) {
 }
 
 
-static bool vm_step_impl(vm_state *vm, uint8_t core_index, uint8_t op, uint8_t b, uint8_t c) {
-	if (CURRENT_CORE->fault != vm_fault_none)
-		return false;
-
-#define fault_if_same(a, b) if ((a) == (b)) do { CURRENT_CORE->fault = vm_fault_illegal_instruction; return false; } while (0)
-
-	switch (op) {
-	case vm_op_Nop: return true;
-
-	case vm_op_Load_Immediate_Byte:     *R1 = B2;               return true;
-	case vm_op_Shift_In_Byte:           *R1 = (*R1 << 8) | B2;  return true;
-	case vm_op_Shift_Left:              *R1 <<= *R2;            return true;
-	case vm_op_Shift_Logical_Right:     *R1 >>= *R2;            return true;
-	case vm_op_Shift_Arithmetic_Right:  *SR1 >>= *R2;           return true;
-
-	case vm_op_Copy: *R1 = *R2; return true;
-
-	case vm_op_Rotate_2: {
-		uint16_t v1 = *R1, v2 = *R2;
-		*R1 = v2; *R2 = v1;
-		return true;
-	}
-
-	case vm_op_Rotate_3: {
-		uint16_t v1 = *R1, v2 = *R2, v3 = *R3;
-		*R1 = v2; *R2 = v3; *R3 = v1;
-		return true;
-	}
-
-	case vm_op_Rotate_4: {
-		uint16_t v1 = *R1, v2 = *R2, v3 = *R3, v4 = *R4;
-		*R1 = v2; *R2 = v3; *R3 = v4; *R4 = v1;
-		return true;
-	}
-
-	case vm_op_Add:      { uint32_t result = *R3 + *R4; fault_if_same(R1, R2); *R1 = result >> 16; *R2 = result & 0xffff; return true; }
-	case vm_op_Subtract: { uint32_t result = *R3 - *R4; fault_if_same(R1, R2); *R1 = result >> 16; *R2 = result & 0xffff; return true; }
-
-	case vm_op_Increment: { uint32_t result = *R2 + B2; fault_if_same(R1, R2); *R1 = result >> 16; *R2 = result & 0xffff; return true; }
-	case vm_op_Decrement: { uint32_t result = *R2 - B2; fault_if_same(R1, R2); *R1 = result >> 16; *R2 = result & 0xffff; return true; }
-
-	case vm_op_Unsigned_Multiply: {
-		uint32_t result = *R3 * *R4;
-		fault_if_same(R1, R2);
-		*R1 = result >> 16;
-		*R2 = result & 0xffff;
-		return true;
-	}
-
-	case vm_op_Signed_Multiply: {
-		union { int32_t s; uint32_t u; } result = { .s = *SR3 * *SR4 };
-		fault_if_same(R1, R2);
-		*R1 = result.u >> 16;
-		*R2 = result.u & 0xffff;
-		return true;
-	}
-
-	case vm_op_Unsigned_Divide: {
-		if (*R4 == 0) { CURRENT_CORE->fault = vm_fault_divide_by_zero; return true; }
-		fault_if_same(R1, R2);
-		*R1 = *R3 / *R4; *R2 = *R3 % *R4;
-		return true;
-	}
-
-	case vm_op_Signed_Divide: {
-		if (*R4 == 0) { CURRENT_CORE->fault = vm_fault_divide_by_zero; return true; }
-		union { int16_t s; uint16_t u; }
-			div = { .s = *SR3 / *SR4 },
-			rem = { .s = *SR3 % *SR4 };
-		fault_if_same(R1, R2);
-		*R1 = div.u; *R2 = rem.u;
-		return true;
-	}
-
-	case vm_op_Compare_Signed:   { bool cmp = *SR3 <= *SR4; fault_if_same(R1, R2); *R1 = cmp; *R2 = !cmp; return true; }
-	case vm_op_Compare_Unsigned: { bool cmp = *R3 <= *R4;   fault_if_same(R1, R2); *R1 = cmp; *R2 = !cmp; return true; }
-	case vm_op_Compare_Equal:    { bool cmp = *R3 == *R4;   fault_if_same(R1, R2); *R1 = cmp; *R2 = !cmp; return true; }
-
-	case vm_op_Branch_Immediate_Absolute: CURRENT_CORE->pc = D;     return false;
-	case vm_op_Branch_Immediate_Relative: CURRENT_CORE->pc += SD;   return false;
-	case vm_op_Branch_Absolute:           CURRENT_CORE->pc = *R1;   return false;
-	case vm_op_Branch_Relative:           CURRENT_CORE->pc += *SR1; return false;
-
-	case vm_op_Skip_If_Zero:     if (*R1 == 0) CURRENT_CORE->pc += 3; return true;
-	case vm_op_Skip_If_Non_Zero: if (*R1 != 0) CURRENT_CORE->pc += 3; return true;
-
-	case vm_op_Read_Address_Byte:      *R1 = vm->memory[*R2]; return true;
-	case vm_op_Read_Address_Two_Byte:  *R1 = (vm->memory[*R2 + 1] << 8) | vm->memory[*R2]; return true;
-	case vm_op_Write_Address_Byte:     vm->memory[*R1] = *R2; return true;
-	case vm_op_Write_Address_Two_Byte: vm->memory[*R1] = *R2; vm->memory[*R1 + 1] = *R2 >> 8; return true;
-
-	case vm_op_Push: vm_push(vm, core_index, *R1); return true;
-	case vm_op_Pop: *R1 = vm_pop(vm, core_index); return true;
-
-	case vm_op_Port_Write: if (vm->ports.port_write) vm->ports.port_write(vm->ports.context, B2, *R1); return true;
-	case vm_op_Port_Read:  if (vm->ports.port_read)  *R1 = vm->ports.port_read(vm->ports.context, B2); return true;
-
-	case vm_op_Call_Immediate_Relative: {
-		uint16_t ret_addr = CURRENT_CORE->pc;
-		vm_push(vm, core_index, ret_addr);
-		CURRENT_CORE->pc += D;
-		return false;
-	}
-
-	case vm_op_Call_Immediate_Absolute: {
-		uint16_t ret_addr = CURRENT_CORE->pc;
-		vm_push(vm, core_index, ret_addr);
-		CURRENT_CORE->pc = D;
-		return false;
-	}
-
-	case vm_op_Call_Relative: {
-		uint16_t ret_addr = CURRENT_CORE->pc;
-		vm_push(vm, core_index, ret_addr);
-		CURRENT_CORE->pc += *SR1;
-		return false;
-	}
-
-	case vm_op_Call_Absolute: {
-		uint16_t ret_addr = CURRENT_CORE->pc;
-		vm_push(vm, core_index, ret_addr);
-		CURRENT_CORE->pc = *R1;
-		return false;
-	}
-
-	case vm_op_Return: CURRENT_CORE->pc = vm_pop(vm, core_index); return true;
-
-	case vm_op_Core:        *R1 = core_index;     return true;
-	case vm_op_Count_Cores: *R1 = vm->core_count; return true;
-
-	case vm_op_Fetch_And_Add_Byte: {
-		uint16_t v2 = *R2;
-		uint8_t v3 = *R3;
-		*R1 = atomic_fetch_add_explicit(&vm->memory[v2], v3, memory_order_relaxed);
-		return true;
-	}
-
-	case vm_op_Fault: CURRENT_CORE->fault = vm_fault_explicitly_requested; return true;
-	}
-
-	CURRENT_CORE->fault = vm_fault_illegal_instruction;
-	return false;
+// the interpreter reads operands from an already decoded instruction
+#undef R1_id
+#undef R2_id
+#undef R3_id
+#undef R4_id
+#undef B2
+#undef D
+#undef SD
+
+#define R1_id (insn.r1)
+#define R2_id (insn.r2)
+#define R3_id (insn.r3)
+#define R4_id (insn.r4)
+
+#define B2 (insn.b2)
+
+#define D (insn.d)
+#define SD ((int16_t)insn.d)
+
+#define VM_INTERP_NAME vm_run_switch
+#define VM_INTERP_THREADED 0
+#include "vm_interp.c"
+#undef VM_INTERP_NAME
+#undef VM_INTERP_THREADED
+
+#if VM_HAVE_THREADED_DISPATCH
+#pragma GCC diagnostic push
+// labels as values, computed gotos and range designators
+#pragma GCC diagnostic ignored "-Wpedantic"
+#define VM_INTERP_NAME vm_run_threaded
+#define VM_INTERP_THREADED 1
+#include "vm_interp.c"
+#undef VM_INTERP_NAME
+#undef VM_INTERP_THREADED
+#pragma GCC diagnostic pop
+#endif
+
+vm_run_result vm_run(vm_state *vm, uint16_t core_index, uint32_t max_steps, uint32_t *steps_run) {
+	uint32_t ignored;
+	if (!steps_run) steps_run = &ignored;
+#if VM_HAVE_THREADED_DISPATCH
+	if (vm->dispatch == vm_dispatch_threaded)
+		return vm_run_threaded(vm, core_index, max_steps, steps_run);
+#endif
+	return vm_run_switch(vm, core_index, max_steps, steps_run);
 }
 
-void vm_step(vm_state *vm, uint8_t core_index) {
-	if (CURRENT_CORE->fault != vm_fault_none) return;
-
-	uint8_t const op = vm->memory[CURRENT_CORE->pc];
-	uint8_t const b = vm->memory[(uint16_t)(CURRENT_CORE->pc + 1)];
-	uint8_t const c = vm->memory[(uint16_t)(CURRENT_CORE->pc + 2)];
-
-	bool inc_pc = vm_step_impl(vm, core_index, op, b, c);
-
-	if (CURRENT_CORE->fault == vm_fault_none && inc_pc) CURRENT_CORE->pc += 3;
+void vm_step(vm_state *vm, uint16_t core_index) {
+	vm_run(vm, core_index, 1, NULL);
 }
@@ -1,43 +1,294 @@
 #ifndef VM_H
 #define VM_H
 
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 #include "ops.h"
 
+// bit counting for the bit instructions, with the host's builtins when there
+// are any
+#if defined(__GNUC__)
+static inline uint16_t vm_popcount(uint16_t x) { return __builtin_popcount(x); }
+static inline uint16_t vm_leading_zeros(uint16_t x) { return x ? __builtin_clz(x) - (__builtin_clz(1) - 15) : 16; }
+static inline uint16_t vm_trailing_zeros(uint16_t x) { return x ? __builtin_ctz(x) : 16; }
+#else
+static inline uint16_t vm_popcount(uint16_t x) { uint16_t n = 0; for (; x; x &= x - 1) ++n; return n; }
+static inline uint16_t vm_leading_zeros(uint16_t x) { uint16_t n = 16; for (; x; x >>= 1) --n; return n; }
+static inline uint16_t vm_trailing_zeros(uint16_t x) { uint16_t n = 0; for (; n < 16 && !(x & 1 << n); ++n); return n; }
+#endif
+
 typedef enum vm_fault {
 	vm_fault_none                  = 0x0,
 	vm_fault_illegal_instruction   = 0x1,
 	vm_fault_divide_by_zero        = 0x2,
+	vm_fault_misaligned_atomic     = 0x3,
 
 	vm_fault_explicitly_requested  = 0xf,
 } vm_fault;
 
+typedef enum vm_run_result {
+	vm_run_budget_exhausted, // executed max_steps instructions
+	vm_run_faulted,          // the core is (or already was) faulted, see vm_core.fault
+	vm_run_port_write,       // stopped right after a portw to a port with stop set
+	vm_run_parked,           // the core is (or already was) parked by a wait, see vm_core.parked
+} vm_run_result;
+
+// how many bytes an idle loop may read and still be parked, see idle_parking
+#define VM_IDLE_MAX_READS 4
+
+// Cores are kept a cache line apart so host threads running neighboring
+// cores don't keep taking the line from each other. While a core runs its
+// pc and registers live in locals of vm_run, the core itself is only
+// written when vm_run returns. Building with -DVM_CACHE_LINE=8 packs them
+// (and vm_state) together again, to measure what that costs.
+#ifndef VM_CACHE_LINE
+#define VM_CACHE_LINE 64
+#endif
+
+typedef enum vm_park {
+	vm_park_none,
+	vm_park_wait, // by wait8/wait16 until a notify
+	vm_park_idle, // in an idle loop until a write, see idle_parking
+} vm_park;
+
+// ncores has to fit in a register
+#define VM_MAX_CORES UINT16_MAX
+
+// every address a 16 bit register can hold
+#define VM_MEMORY_SIZE 0x10000
+// Memory is followed by this many bytes that are the same bytes as its
+// first ones (host_map_memory mirrors a whole page there), so double bytes
+// and instructions that run past the end wrap around with plain loads. Only
+// Linux hosts can map a mirror, elsewhere there is none and accesses past
+// the end wrap around with casts instead.
+#ifdef __linux__
+#define VM_MEMORY_MIRROR 2
+#else
+#define VM_MEMORY_MIRROR 0
+#endif
+
+// the index into memory of an address up to VM_MEMORY_MIRROR bytes past
+// the end
+#define vm_mirrored(address) (VM_MEMORY_MIRROR ? (uint32_t)(address) : (uint16_t)(address))
+
 typedef struct vm_core {
 	// on faults pc points to the instruction that faulted
 
-	uint16_t pc;
+	_Alignas(VM_CACHE_LINE) uint16_t pc;
 	uint16_t registers[16];
 	uint8_t fault;
 
+	// a vm_park, vm_run doesn't run parked cores so hosts should pick
+	// another one
+	_Atomic uint8_t parked;
+	_Atomic uint16_t parked_on; // what a wait is waiting for a notify on
+
+	// when parked in an idle loop, idle_watch_count bytes at idle_watch
+	// held idle_watch_values
+	uint8_t idle_watch_count;
+	_Atomic uint16_t idle_watch[VM_IDLE_MAX_READS];
+	_Atomic uint8_t idle_watch_values[VM_IDLE_MAX_READS];
+
 	// TODO: interrupts, vectors, etc
 } vm_core;
 
-typedef struct vm_ports {
+_Static_assert(sizeof(vm_core) % VM_CACHE_LINE == 0, "cores should not share cache lines");
+
+// The handlers of one port, either may be NULL. portr on a port without a
+// read handler leaves the register as it was, portw on one without a write
+// handler does nothing.
+typedef struct vm_port {
 	void *context; // passed to every call to read and write, not touched by the vm itself
-	uint16_t (*port_read)(void *context, uint8_t port_number);
-	void (*port_write)(void *context, uint8_t port_number, uint16_t data);
-} vm_ports;
+	uint16_t (*read)(void *context, uint8_t port_number);
+	void (*write)(void *context, uint8_t port_number, uint16_t data);
+	bool stop; // vm_run returns right after a portw so the host can react to it (e.g. a shut down)
+} vm_port;
+
+// computed goto dispatch is a GCC/clang extension, define
+// VM_NO_THREADED_DISPATCH to build with only the portable switch
+#if defined(__GNUC__) && !defined(VM_NO_THREADED_DISPATCH)
+#define VM_HAVE_THREADED_DISPATCH 1
+#else
+#define VM_HAVE_THREADED_DISPATCH 0
+#endif
+
+typedef enum vm_dispatch {
+	vm_dispatch_threaded, // falls back to vm_dispatch_switch when not available
+	vm_dispatch_switch,
+} vm_dispatch;
+
+// the JIT emits x86-64 machine code and needs memfd_create to map its code
+// writable and executable at two addresses, define VM_NO_JIT to leave it out
+#if defined(__x86_64__) && defined(__linux__) && !defined(VM_NO_JIT)
+#define VM_HAVE_JIT 1
+#else
+#define VM_HAVE_JIT 0
+#endif
+
+typedef struct vm_decode_cache vm_decode_cache;
+typedef struct vm_jit vm_jit;
 
-typedef struct vm_state {
+typedef struct vm_state vm_state;
+struct vm_state {
 	vm_core *cores;
-	uint8_t core_count;
+	uint16_t core_count; // at most VM_MAX_CORES
+
+	vm_port ports[256]; // indexed by port number, see vm_register_port
+	vm_dispatch dispatch; // which interpreter loop vm_run uses
+	vm_decode_cache *decode_cache; // NULL to decode every instruction every time
+	vm_jit *jit; // NULL to only interpret
+	void (*on_wake)(vm_state *); // called after a notify or a write woke parked cores, may be NULL
+
+	// Park cores that spin in a short loop which writes nothing, does no
+	// port I/O and comes back around with the same registers. They wake when
+	// something writes a byte the loop reads, or never for a loop that reads
+	// nothing. Off after vm_init.
+	bool idle_parking;
+	// VM_MEMORY_SIZE bytes and their VM_MEMORY_MIRROR, aligned to 2 (the
+	// 16 bit atomics use it as _Atomic uint16_t). Like the cores it belongs
+	// to the host, see host_map_memory.
+	uint8_t *memory;
+
+	// Everything above is only read while cores run, what follows is written
+	// by every thread (once a quantum, or when cores park and wake), so it
+	// starts a cache line of its own.
+	_Alignas(VM_CACHE_LINE) _Atomic uint64_t fusions_fired[vm_fusion_count]; // how often each vm_fusion ran
+	_Atomic uint32_t waiting; // cores parked by wait, notify doesn't look through the cores without any
+	_Atomic uint32_t idle_parks; // how often a core was parked by idle_parking
+	_Atomic uint32_t idle_parked; // cores parked that way right now, writes skip the rest while it is 0
+	_Atomic uint32_t wakes; // bumped whenever parked cores wake, hosts keeping them aside look again when it changes
+	_Atomic uint16_t idle_watchers[0x100]; // watched bytes in each 256 byte region
+};
+
+// Guest memory as instructions access it. Ordinary loads and stores are
+// relaxed atomics a byte at a time, so cores racing on memory (which the
+// memory model in ops.h allows) is well defined on the host too. Double
+// bytes at the end of memory take their second byte from the mirror.
+#define vm_atomic_byte(vm, address) ((_Atomic uint8_t *)&(vm)->memory[(uint16_t)(address)])
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "the 16 bit atomics need a little endian host"
+#endif
+#define vm_atomic_two_byte(vm, even_address) ((_Atomic uint16_t *)&(vm)->memory[(uint16_t)(even_address)])
+
+static inline uint8_t vm_load_byte(vm_state const *vm, uint16_t address) {
+	return atomic_load_explicit(vm_atomic_byte((vm_state *)vm, address), memory_order_relaxed);
+}
+
+static inline void vm_store_byte(vm_state *vm, uint16_t address, uint8_t value) {
+	atomic_store_explicit(vm_atomic_byte(vm, address), value, memory_order_relaxed);
+}
+
+#define vm_atomic_second_byte(vm, address) ((_Atomic uint8_t *)&(vm)->memory[vm_mirrored((uint32_t)(address) + 1)])
+
+static inline uint16_t vm_load_two_byte(vm_state const *vm, uint16_t address) {
+	return atomic_load_explicit(vm_atomic_second_byte((vm_state *)vm, address), memory_order_relaxed) << 8 | vm_load_byte(vm, address);
+}
+
+static inline void vm_store_two_byte(vm_state *vm, uint16_t address, uint16_t value) {
+	vm_store_byte(vm, address, value & 0xff);
+	atomic_store_explicit(vm_atomic_second_byte(vm, address), value >> 8, memory_order_relaxed);
+}
+
+void vm_init(vm_state *, uint16_t core_count, vm_core *cores, uint8_t *memory);
+void vm_step(vm_state *, uint16_t core_index);
+
+// replaces the handlers of one port, registering (vm_port){ 0 } removes them
+void vm_register_port(vm_state *, uint8_t port_number, vm_port);
+
+// runs up to max_steps instructions on one core without returning to the
+// host, and stores how many it ran in steps_run unless that is NULL
+vm_run_result vm_run(vm_state *, uint16_t core_index, uint32_t max_steps, uint32_t *steps_run);
+
+static inline bool vm_core_parked(vm_core *core) {
+	return atomic_load_explicit(&core->parked, memory_order_acquire) != vm_park_none;
+}
+
+// What wait8/wait16 and notify do, for translated code and for hosts that
+// write memory cores may be waiting on. vm_wait returns whether it parked
+// the core.
+bool vm_wait(vm_state *, uint16_t core_index, uint16_t address, uint16_t expected, bool two_byte);
+void vm_notify(vm_state *, uint16_t address);
+
+// vm_run counts how often a core comes back to the target of a backward
+// branch. Every VM_IDLE_ROUNDS times in a row vm_idle_arrived compares the
+// registers with those of the time before, returning true if they are the
+// same, and then the loop from there gets checked. Only looking every so
+// often keeps loops that do work from paying for a copy of the registers
+// on every branch back.
+#define VM_IDLE_ROUNDS 16
+
+typedef struct vm_idle_detector {
+	uint16_t head;
+	uint16_t rounds;
+	uint16_t registers[16];
+} vm_idle_detector;
+
+static inline bool vm_idle_look(vm_idle_detector *idle, uint16_t head, uint16_t const *registers) {
+	if (idle->head != head) {
+		idle->head = head;
+		idle->rounds = 0;
+		return false;
+	}
+	idle->rounds = 0;
+	if (memcmp(idle->registers, registers, sizeof idle->registers) == 0)
+		return true;
+	// the first look after a new head compares with registers from the old
+	// one, if those happen to match vm_idle_park still checks the loop
+	memcpy(idle->registers, registers, sizeof idle->registers);
+	return false;
+}
+
+// counts in place so that the branches back in between cost no call, even
+// in builds that don't inline
+#define vm_idle_arrived(detector, at, registers) \
+	(((detector)->head != (at) || ++(detector)->rounds >= VM_IDLE_ROUNDS) && vm_idle_look((detector), (at), (registers)))
+
+// For translated code, which finds loops with vm_idle_arrived like vm_run
+// does. Parks the core if the loop at head is idle and returns whether it
+// did. The core goes on at head with these registers when it wakes, so
+// they must be written back to it.
+bool vm_idle_park(vm_state *, uint16_t core_index, uint16_t head, uint16_t const *registers);
+
+// Wakes a core parked by idle_parking if memory it was watching changed
+// without it being woken, which can happen when a write races with the
+// core parking. Hosts should call it now and then for cores they are
+// sleeping on, it returns whether the core is awake.
+bool vm_recheck_idle(vm_state *, uint16_t core_index);
+
+// The bulk memory instructions, for hosts (and translated code) that want
+// to do the same. Copies and fills note their writes like instructions do.
+void vm_memory_copy(vm_state *, uint16_t to, uint16_t from, uint16_t length);
+void vm_memory_fill(vm_state *, uint16_t to, uint8_t value, uint16_t length);
+uint16_t vm_memory_compare(vm_state const *, uint16_t a, uint16_t b, uint16_t length);
+uint16_t vm_memory_scan(vm_state const *, uint16_t from, uint8_t value, uint16_t length);
+
+// Copies length bytes of guest memory at address out to the host or in from
+// it, wrapping around at the end. With more than one core these are byte
+// loads and stores like vm_load_byte's, with one they are memcpy. Neither
+// notes the write, see vm_invalidate_decoded.
+void vm_load_bytes(vm_state const *, uint16_t address, uint8_t *to, uint16_t length);
+void vm_store_bytes(vm_state *, uint16_t address, uint8_t const *from, uint16_t length);
 
-	vm_ports ports;
-	uint8_t memory[UINT16_MAX];
-} vm_state;
+// Caches decoded instructions so straight-line code is only decoded once.
+// Writes done by instructions invalidate the cache themselves, but a host
+// that writes vm->memory directly while it is enabled must call
+// vm_invalidate_decoded afterwards.
+//
+// Like real hardware, modifying code that another core is running needs
+// synchronization between the cores to be seen reliably.
+bool vm_enable_decode_cache(vm_state *);
+void vm_disable_decode_cache(vm_state *);
+void vm_invalidate_decoded(vm_state *, uint16_t address, uint16_t length);
 
-void vm_init(vm_state *, uint8_t core_count, vm_core *cores);
-void vm_step(vm_state *, uint8_t core_index);
+// Compiles frequently reached blocks of code to native code (when
+// VM_HAVE_JIT). Compiled code is dropped by the same writes that invalidate
+// the decode cache, vm_invalidate_decoded included. vm_enable_jit returns
+// false when the JIT is not available or its memory could not be mapped.
+bool vm_enable_jit(vm_state *);
+void vm_disable_jit(vm_state *);
+uint32_t vm_jit_block_count(vm_state const *); // blocks compiled so far
 
 char const *vm_padded_reg_name(uint8_t);
 
@@ -45,9 +296,10 @@ char const *vm_op_mnemonic(uint8_t code);
 vm_operands vm_op_encoding(uint8_t code);
 char const *vm_op_name(uint8_t);
 char const *vm_fault_name(vm_fault);
+char const *vm_fusion_name(vm_fusion);
 
 // these point to mutable static memory
 char const *vm_disasm(uint8_t, uint8_t, uint8_t);
-char const *vm_disasm_pc(vm_state const *, uint8_t core_index);
+char const *vm_disasm_pc(vm_state const *, uint16_t core_index);
 
 #endif // VM_H
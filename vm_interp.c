@@ -0,0 +1,425 @@
+// The body of the interpreter loop, included by vm.c once per dispatch
+// strategy. Expects these to be defined:
+//
+//     VM_INTERP_NAME      name of the function to define
+//     VM_INTERP_THREADED  1 to dispatch through a table of label addresses
+//                         (GCC/clang extension), 0 for a portable switch
+
+static vm_run_result VM_INTERP_NAME(vm_state *vm, uint16_t core_index, uint32_t max_steps, uint32_t *steps_run) {
+	vm_core *const core = &vm->cores[core_index];
+	*steps_run = 0;
+	if (core->fault != vm_fault_none)
+		return vm_run_faulted;
+	if (vm_core_parked(core))
+		return vm_run_parked;
+
+	// pc and registers live in locals for the whole run and are only written
+	// back to the core when we stop
+	uint16_t pc = core->pc;
+	uint16_t regs[16];
+	memcpy(regs, core->registers, sizeof regs);
+
+	vm_run_result stopped_because = vm_run_budget_exhausted;
+	uint32_t steps = 0;
+	vm_decode_cache *const cache = vm->decode_cache;
+	vm_jit *const jit = vm->jit;
+	vm_decoded insn;
+	uint32_t fusions_fired[vm_fusion_count] = { 0 };
+	bool const idle_parking = vm->idle_parking;
+	vm_idle_detector idle = { .head = pc, .rounds = 0 };
+
+// Fusions only come from the cache. Decoding them on every fetch costs more
+// than it saves, a skip over the rest of a sequence decodes it for nothing.
+#define fetch() do { insn = cache ? vm_fetch_cached(vm, cache, pc) : vm_decode(vm, pc); } while (0)
+
+#if VM_INTERP_THREADED
+#define X(name, mnemonic, encoding) [vm_op_##name] = &&op_##name,
+#define F(name, length, first, second, third) [vm_handler_first_fused + vm_fusion_##name] = &&fused_##name,
+	static void *const dispatch_table[256] = {
+		vm_x_instructions(X)
+		[vm_handler_illegal] = &&op_illegal,
+		vm_x_fusions(F)
+		[vm_handler_count ... 255] = &&op_illegal,
+	};
+#undef X
+#undef F
+
+	// every handler ends in its own copy of this, giving the host branch
+	// predictor one indirect jump per instruction to learn from
+#define dispatch() do { \
+	if (steps == max_steps) goto stop; \
+	++steps; \
+	fetch(); \
+	goto *dispatch_table[insn.handler]; \
+} while (0)
+#define redispatch() goto *dispatch_table[insn.handler]
+#define op_case(name) op_##name:
+#define fused_label(name) fused_##name:
+#define op_default op_illegal:
+#else
+#define dispatch() goto next_step
+#define redispatch() goto execute
+#define op_case(name) case vm_op_##name:
+#define fused_label(name) case vm_handler_first_fused + vm_fusion_##name:
+#define op_default default:
+#endif
+
+// a fused handler runs instead of the first instruction of its sequence, so
+// it only counts the steps past that one. If the budget would run out partway
+// through the sequence, run its instructions one by one instead.
+#define fused_case(name) fused_label(name) \
+	if (max_steps - steps < vm_fusion_length_##name - 1) goto unfuse; \
+	++fusions_fired[vm_fusion_##name];
+
+#define fault(f) do { core->fault = (f); stopped_because = vm_run_faulted; goto stop; } while (0)
+#define fault_if_same(a, b) do { if ((a) == (b)) fault(vm_fault_illegal_instruction); } while (0)
+#define next() do { pc += 3; dispatch(); } while (0)
+#define pair(high, low) ((uint32_t)*(high) << 16 | *(low))
+// compiled blocks start at branch targets, so that is where we look for them
+#define jump(addr) do { \
+	uint16_t const target_ = (addr); \
+	if (idle_parking && target_ <= pc && vm_idle_arrived(&idle, target_, regs)) { pc = target_; goto park_idle; } \
+	pc = target_; \
+	if (jit) goto enter_jit; \
+	dispatch(); \
+} while (0)
+
+	if (jit) goto enter_jit;
+
+#if VM_INTERP_THREADED
+	dispatch();
+	{
+#else
+next_step:
+	if (steps == max_steps) goto stop;
+	++steps;
+	fetch();
+
+execute:
+	switch (insn.handler) {
+#endif
+	op_case(Nop) next();
+
+	op_case(Load_Immediate_Byte)     *R1 = B2;               next();
+	op_case(Shift_In_Byte)           *R1 = (*R1 << 8) | B2;  next();
+	op_case(Shift_Left)              *R1 <<= *R2;            next();
+	op_case(Shift_Logical_Right)     *R1 >>= *R2;            next();
+	op_case(Shift_Arithmetic_Right)  *SR1 >>= *R2;           next();
+
+	op_case(Copy) *R1 = *R2; next();
+
+	op_case(Rotate_2) {
+		uint16_t v1 = *R1, v2 = *R2;
+		*R1 = v2; *R2 = v1;
+		next();
+	}
+
+	op_case(Rotate_3) {
+		uint16_t v1 = *R1, v2 = *R2, v3 = *R3;
+		*R1 = v2; *R2 = v3; *R3 = v1;
+		next();
+	}
+
+	op_case(Rotate_4) {
+		uint16_t v1 = *R1, v2 = *R2, v3 = *R3, v4 = *R4;
+		*R1 = v2; *R2 = v3; *R3 = v4; *R4 = v1;
+		next();
+	}
+
+	op_case(Add)      { uint32_t result = *R3 + *R4; fault_if_same(R1, R2); *R1 = result >> 16; *R2 = result & 0xffff; next(); }
+	op_case(Subtract) { uint32_t result = *R3 - *R4; fault_if_same(R1, R2); *R1 = result >> 16; *R2 = result & 0xffff; next(); }
+
+	op_case(Increment) { uint32_t result = *R2 + B2; fault_if_same(R1, R2); *R1 = result >> 16; *R2 = result & 0xffff; next(); }
+	op_case(Decrement) { uint32_t result = *R2 - B2; fault_if_same(R1, R2); *R1 = result >> 16; *R2 = result & 0xffff; next(); }
+
+	op_case(Unsigned_Multiply) {
+		uint32_t result = *R3 * *R4;
+		fault_if_same(R1, R2);
+		*R1 = result >> 16;
+		*R2 = result & 0xffff;
+		next();
+	}
+
+	op_case(Signed_Multiply) {
+		union { int32_t s; uint32_t u; } result = { .s = *SR3 * *SR4 };
+		fault_if_same(R1, R2);
+		*R1 = result.u >> 16;
+		*R2 = result.u & 0xffff;
+		next();
+	}
+
+	op_case(Unsigned_Divide) {
+		if (*R4 == 0) fault(vm_fault_divide_by_zero);
+		fault_if_same(R1, R2);
+		*R1 = *R3 / *R4; *R2 = *R3 % *R4;
+		next();
+	}
+
+	op_case(Signed_Divide) {
+		if (*R4 == 0) fault(vm_fault_divide_by_zero);
+		union { int16_t s; uint16_t u; }
+			div = { .s = *SR3 / *SR4 },
+			rem = { .s = *SR3 % *SR4 };
+		fault_if_same(R1, R2);
+		*R1 = div.u; *R2 = rem.u;
+		next();
+	}
+
+	op_case(Compare_Signed)   { bool cmp = *SR3 <= *SR4; fault_if_same(R1, R2); *R1 = cmp; *R2 = !cmp; next(); }
+	op_case(Compare_Unsigned) { bool cmp = *R3 <= *R4;   fault_if_same(R1, R2); *R1 = cmp; *R2 = !cmp; next(); }
+	op_case(Compare_Equal)    { bool cmp = *R3 == *R4;   fault_if_same(R1, R2); *R1 = cmp; *R2 = !cmp; next(); }
+
+	op_case(Branch_Immediate_Absolute) jump(D);
+	op_case(Branch_Immediate_Relative) jump(pc + SD);
+	op_case(Branch_Absolute)           jump(*R1);
+	op_case(Branch_Relative)           jump(pc + *SR1);
+
+	op_case(Skip_If_Zero)     if (*R1 == 0) pc += 3; next();
+	op_case(Skip_If_Non_Zero) if (*R1 != 0) pc += 3; next();
+
+	op_case(Read_Address_Byte)      *R1 = vm_load_byte(vm, *R2); next();
+	op_case(Read_Address_Two_Byte)  *R1 = vm_load_two_byte(vm, *R2); next();
+	op_case(Write_Address_Byte)     vm_store_byte(vm, *R1, *R2); vm_note_write(vm, *R1, 1); next();
+	op_case(Write_Address_Two_Byte) vm_store_two_byte(vm, *R1, *R2); vm_note_long_write(vm, *R1, 2); next();
+
+	op_case(Push) vm_push(vm, &regs[15], *R1); next();
+	op_case(Pop) *R1 = vm_pop(vm, &regs[15]); next();
+
+	op_case(Port_Write)
+		if (vm->ports[B2].write) vm->ports[B2].write(vm->ports[B2].context, B2, *R1);
+		if (!vm->ports[B2].stop) next();
+		pc += 3;
+		stopped_because = vm_run_port_write;
+		goto stop;
+
+	op_case(Port_Read) if (vm->ports[B2].read) *R1 = vm->ports[B2].read(vm->ports[B2].context, B2); next();
+
+	op_case(Call_Immediate_Relative) vm_push(vm, &regs[15], pc); jump(pc + D);
+	op_case(Call_Immediate_Absolute) vm_push(vm, &regs[15], pc); jump(D);
+	op_case(Call_Relative)           vm_push(vm, &regs[15], pc); jump(pc + *SR1);
+	op_case(Call_Absolute)           vm_push(vm, &regs[15], pc); jump(*R1);
+
+	op_case(Return) pc = vm_pop(vm, &regs[15]); next();
+
+	op_case(Core)        *R1 = core_index;     next();
+	op_case(Count_Cores) *R1 = vm->core_count; next();
+
+	op_case(Fetch_And_Add_Byte) {
+		uint16_t v2 = *R2;
+		uint8_t v3 = *R3;
+		*R1 = atomic_fetch_add_explicit(vm_atomic_byte(vm, v2), v3, memory_order_relaxed);
+		vm_note_write(vm, v2, 1);
+		next();
+	}
+
+	op_case(Fetch_And_Add_Two_Byte) {
+		uint16_t address = *R2, value = *R3;
+		if (address & 1) fault(vm_fault_misaligned_atomic);
+		*R1 = atomic_fetch_add_explicit(vm_atomic_two_byte(vm, address), value, memory_order_relaxed);
+		vm_note_write(vm, address, 2);
+		next();
+	}
+
+	op_case(Compare_And_Swap_Byte) {
+		uint16_t address = *R2;
+		uint8_t old = *R3;
+		if (atomic_compare_exchange_strong_explicit(vm_atomic_byte(vm, address), &old, *R4, memory_order_relaxed, memory_order_relaxed))
+			vm_note_write(vm, address, 1);
+		*R1 = old;
+		next();
+	}
+
+	op_case(Compare_And_Swap_Two_Byte) {
+		uint16_t address = *R2, old = *R3;
+		if (address & 1) fault(vm_fault_misaligned_atomic);
+		if (atomic_compare_exchange_strong_explicit(vm_atomic_two_byte(vm, address), &old, *R4, memory_order_relaxed, memory_order_relaxed))
+			vm_note_write(vm, address, 2);
+		*R1 = old;
+		next();
+	}
+
+	op_case(Exchange_Byte) {
+		uint16_t address = *R2;
+		*R1 = atomic_exchange_explicit(vm_atomic_byte(vm, address), *R3, memory_order_relaxed);
+		vm_note_write(vm, address, 1);
+		next();
+	}
+
+	op_case(Exchange_Two_Byte) {
+		uint16_t address = *R2;
+		if (address & 1) fault(vm_fault_misaligned_atomic);
+		*R1 = atomic_exchange_explicit(vm_atomic_two_byte(vm, address), *R3, memory_order_relaxed);
+		vm_note_write(vm, address, 2);
+		next();
+	}
+
+	op_case(Wait_Byte)
+	op_case(Wait_Two_Byte)
+		if (!vm_wait(vm, core_index, *R1, *R2, insn.handler == vm_op_Wait_Two_Byte)) next();
+		pc += 3;
+		stopped_because = vm_run_parked;
+		goto stop;
+
+	op_case(Notify) vm_notify(vm, *R1); next();
+
+	op_case(Fence_Acquire) atomic_thread_fence(memory_order_acquire); next();
+	op_case(Fence_Release) atomic_thread_fence(memory_order_release); next();
+	op_case(Fence)         atomic_thread_fence(memory_order_seq_cst); next();
+
+	op_case(Memory_Copy)    vm_memory_copy(vm, *R1, *R2, *R3);        next();
+	op_case(Memory_Fill)    vm_memory_fill(vm, *R1, *R2, *R3);        next();
+	op_case(Memory_Compare) *R1 = vm_memory_compare(vm, *R2, *R3, *R4); next();
+	op_case(Memory_Scan)    *R1 = vm_memory_scan(vm, *R2, *R3, *R4);    next();
+
+	op_case(Population_Count)     *R1 = vm_popcount(*R2);       next();
+	op_case(Count_Leading_Zeros)  *R1 = vm_leading_zeros(*R2);  next();
+	op_case(Count_Trailing_Zeros) *R1 = vm_trailing_zeros(*R2); next();
+	op_case(Byte_Swap)            *R1 = *R2 << 8 | *R2 >> 8;    next();
+
+	op_case(Bit_Test_And_Set) {
+		uint16_t bit = 1 << (*R3 & 15), value = *R2;
+		fault_if_same(R1, R2);
+		*R1 = (value & bit) != 0; *R2 = value | bit;
+		next();
+	}
+
+	op_case(Bit_Test_And_Clear) {
+		uint16_t bit = 1 << (*R3 & 15), value = *R2;
+		fault_if_same(R1, R2);
+		*R1 = (value & bit) != 0; *R2 = value & ~bit;
+		next();
+	}
+
+	op_case(Add_Pair)      { uint32_t result = pair(R1, R2) + pair(R3, R4); fault_if_same(R1, R2); *R1 = result >> 16; *R2 = result & 0xffff; next(); }
+	op_case(Subtract_Pair) { uint32_t result = pair(R1, R2) - pair(R3, R4); fault_if_same(R1, R2); *R1 = result >> 16; *R2 = result & 0xffff; next(); }
+	op_case(Shift_Left_Pair)          { uint32_t result = pair(R1, R2) << (*R3 & 31); fault_if_same(R1, R2); *R1 = result >> 16; *R2 = result & 0xffff; next(); }
+	op_case(Shift_Logical_Right_Pair) { uint32_t result = pair(R1, R2) >> (*R3 & 31); fault_if_same(R1, R2); *R1 = result >> 16; *R2 = result & 0xffff; next(); }
+
+	op_case(Compare_Unsigned_Pair) { bool cmp = pair(R1, R2) <= pair(R3, R4); fault_if_same(R1, R2); *R1 = cmp; *R2 = !cmp; next(); }
+	op_case(Compare_Signed_Pair) {
+		union { uint32_t u; int32_t s; } a = { .u = pair(R1, R2) }, b = { .u = pair(R3, R4) };
+		bool cmp = a.s <= b.s;
+		fault_if_same(R1, R2);
+		*R1 = cmp; *R2 = !cmp;
+		next();
+	}
+
+	op_case(Read_Address_Four_Byte) {
+		uint32_t value = vm_read_four_byte(vm, *R3);
+		fault_if_same(R1, R2);
+		*R1 = value >> 16; *R2 = value & 0xffff;
+		next();
+	}
+
+	op_case(Write_Address_Four_Byte) {
+		uint16_t address = *R1;
+		vm_write_four_byte(vm, address, pair(R2, R3));
+		vm_note_long_write(vm, address, 4);
+		next();
+	}
+
+	op_case(Fault) fault(vm_fault_explicitly_requested);
+
+	fused_case(Load_Immediate_Double) *R1 = D; steps += 1; pc += 6; dispatch();
+
+	fused_case(Branch_If_Non_Zero) {
+		if (*R1 == 0) { pc += 6; dispatch(); }
+		steps += 1;
+		jump(D);
+	}
+
+	fused_case(Branch_If_Zero) {
+		if (*R1 != 0) { pc += 6; dispatch(); }
+		steps += 1;
+		jump(D);
+	}
+
+	fused_case(Read_Branch_If_Non_Zero) {
+		*R1 = vm_load_byte(vm, *R2);
+		steps += 1;
+		if (*R3 == 0) { pc += 9; dispatch(); }
+		steps += 1;
+		jump(D);
+	}
+
+	fused_case(Read_Branch_If_Zero) {
+		*R1 = vm_load_byte(vm, *R2);
+		steps += 1;
+		if (*R3 != 0) { pc += 9; dispatch(); }
+		steps += 1;
+		jump(D);
+	}
+
+	// in vm_x_instructions, but not implemented yet
+	op_case(Copy_2)
+	op_case(Copy_3)
+	op_case(Bit_Or)
+	op_case(Bit_Xor)
+	op_case(Bit_And)
+	op_default
+		fault(vm_fault_illegal_instruction);
+	}
+
+unfuse:
+	insn = vm_decode(vm, pc);
+	redispatch();
+
+park_idle:
+	if (vm_idle_park(vm, core_index, pc, regs)) {
+		stopped_because = vm_run_parked;
+		goto stop;
+	}
+	if (jit) goto enter_jit;
+	dispatch();
+
+enter_jit:
+	// keep running compiled blocks for as long as they lead into each other
+	vm_jit_enter(jit);
+	while (max_steps - steps >= VM_JIT_MAX_BLOCK_STEPS) {
+		vm_jit_block block = vm_jit_block_at(vm, jit, pc);
+		if (!block) break;
+
+		uint16_t const entered = pc;
+		uint32_t exit = block(regs);
+		uint32_t ran = (exit >> 16) & 0x7fff;
+		pc = exit & 0xffff;
+		steps += ran;
+		if (exit & VM_JIT_EXIT_STOP) {
+			vm_jit_leave(jit);
+			stopped_because = vm_run_port_write;
+			goto stop;
+		}
+		// the block left its first instruction to us (e.g. to fault)
+		if (ran == 0) break;
+		// a block that loops back to itself (or further) is a loop as far
+		// as idle detection is concerned
+		if (idle_parking && pc <= entered && vm_idle_arrived(&idle, pc, regs)) {
+			vm_jit_leave(jit);
+			goto park_idle;
+		}
+	}
+	vm_jit_leave(jit);
+	dispatch();
+
+#undef fetch
+#undef dispatch
+#undef redispatch
+#undef op_case
+#undef fused_label
+#undef fused_case
+#undef op_default
+#undef fault
+#undef fault_if_same
+#undef next
+#undef pair
+#undef jump
+
+stop:
+	core->pc = pc;
+	memcpy(core->registers, regs, sizeof regs);
+	*steps_run = steps;
+	for (uint8_t i = 0; i < vm_fusion_count; ++i)
+		if (fusions_fired[i])
+			atomic_fetch_add_explicit(&vm->fusions_fired[i], fusions_fired[i], memory_order_relaxed);
+	return stopped_because;
+}
@@ -0,0 +1,946 @@
+// Baseline x86-64 JIT, included by vm.c when VM_HAVE_JIT is set.
+//
+// Branch targets that get reached often enough are translated, one basic
+// block at a time, into native functions in an arena. The arena is mapped
+// twice, writable for emitting code and executable for running it, so no
+// page is ever both. Blocks run straight-line code up to the first branch,
+// skip, call, ret or portw and hand the new pc back to the interpreter, which
+// looks up the next block.
+//
+// Dropped blocks stay in the arena until it fills up. Then every block is
+// thrown away and the arena starts over, once no other thread is running
+// compiled code.
+//
+// Register conventions inside a block:
+//
+//     rbx                  the core's registers (the interpreter's locals)
+//     r12                  vm->memory
+//     rbp, r13, r14, r15   the block's most used guest registers
+//     eax, ecx, edx, esi   scratch
+//
+// Anything that can fault (divides, rrrr ops naming the same register twice,
+// illegal instructions) or needs the core (core, ncores) ends the block
+// before it, so the interpreter raises the fault exactly like before. Stores,
+// fetchadd and port I/O call back into C.
+
+#include <sys/mman.h>
+#include <threads.h>
+#include <unistd.h>
+
+_Static_assert(VM_MEMORY_MIRROR >= 1, "the JIT reads double bytes at 0xffff from the mirror");
+
+#define VM_JIT_ARENA_SIZE (8u << 20)
+#define VM_JIT_HOT 32          // times a branch target is reached before it gets compiled
+#define VM_JIT_GAVE_UP 0xff    // heat of targets we could not (or will not) compile
+#define VM_JIT_MAX_BLOCK_CODE (VM_JIT_MAX_BLOCK_STEPS * 96 + 256) // upper bound on the native size of a block
+
+struct vm_jit {
+	mtx_t lock; // held while compiling or invalidating
+	uint8_t *arena; // writable view
+	uint8_t *code; // executable view of the same pages
+	size_t arena_used;
+	_Atomic uint32_t block_count;
+	_Atomic uint32_t inside; // threads between vm_jit_enter and vm_jit_leave
+
+	_Atomic(void *) entries[0x10000];   // native code for the block starting at each pc
+	_Atomic uint8_t spans[0x10000];     // how many bytes of guest code each of those blocks covers
+	_Atomic uint8_t heat[0x10000];
+	_Atomic bool region_has_code[0x100];
+};
+
+bool vm_enable_jit(vm_state *vm) {
+	if (vm->jit) return true;
+
+	vm_jit *jit = malloc(sizeof *jit);
+	if (!jit) return false;
+
+	int const file = memfd_create("lil-vm jit", MFD_CLOEXEC);
+	if (file < 0) goto fail_file;
+	if (ftruncate(file, VM_JIT_ARENA_SIZE) != 0) goto fail_arena;
+	jit->arena = mmap(NULL, VM_JIT_ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+	if (jit->arena == MAP_FAILED) goto fail_arena;
+	jit->code = mmap(NULL, VM_JIT_ARENA_SIZE, PROT_READ | PROT_EXEC, MAP_SHARED, file, 0);
+	if (jit->code == MAP_FAILED) goto fail_code;
+	if (mtx_init(&jit->lock, mtx_plain) != thrd_success) goto fail_lock;
+	// the mappings keep the file
+	close(file);
+
+	jit->arena_used = 0;
+	atomic_init(&jit->block_count, 0);
+	atomic_init(&jit->inside, 0);
+	for (uint32_t i = 0; i < 0x10000; ++i) {
+		atomic_init(&jit->entries[i], NULL);
+		atomic_init(&jit->spans[i], 0);
+		atomic_init(&jit->heat[i], 0);
+	}
+	for (uint32_t i = 0; i < 0x100; ++i)
+		atomic_init(&jit->region_has_code[i], false);
+
+	vm->jit = jit;
+	return true;
+
+fail_lock: munmap(jit->code, VM_JIT_ARENA_SIZE);
+fail_code: munmap(jit->arena, VM_JIT_ARENA_SIZE);
+fail_arena: close(file);
+fail_file: free(jit);
+	return false;
+}
+
+void vm_disable_jit(vm_state *vm) {
+	if (!vm->jit) return;
+	mtx_destroy(&vm->jit->lock);
+	munmap(vm->jit->arena, VM_JIT_ARENA_SIZE);
+	munmap(vm->jit->code, VM_JIT_ARENA_SIZE);
+	free(vm->jit);
+	vm->jit = NULL;
+}
+
+// Around the loop in vm_run that runs blocks. A thread in it may hold on to
+// a block that was just dropped, so the arena can only start over while no
+// other thread is.
+static void vm_jit_enter(vm_jit *jit) {
+	atomic_fetch_add_explicit(&jit->inside, 1, memory_order_seq_cst);
+	// pairs with the one in vm_jit_reset, either we see the blocks gone or
+	// it sees us here
+	atomic_thread_fence(memory_order_seq_cst);
+}
+
+static void vm_jit_leave(vm_jit *jit) {
+	atomic_fetch_sub_explicit(&jit->inside, 1, memory_order_release);
+}
+
+uint32_t vm_jit_block_count(vm_state const *vm) {
+	return vm->jit ? atomic_load_explicit(&vm->jit->block_count, memory_order_relaxed) : 0;
+}
+
+// drops every block that covers a written byte, returns whether there were any
+static bool vm_jit_note_write(vm_jit *jit, uint16_t address, uint16_t length) {
+	if (!jit) return false;
+
+	uint16_t const last = address + length - 1;
+	if (!atomic_load_explicit(&jit->region_has_code[address >> 8], memory_order_relaxed)
+		&& !atomic_load_explicit(&jit->region_has_code[last >> 8], memory_order_relaxed))
+		return false;
+
+	bool invalidated = false;
+	mtx_lock(&jit->lock);
+	// blocks never wrap around the end of memory, so only ones starting up
+	// to a block's worth of bytes before the write can cover it
+	for (uint32_t start = address > 3 * VM_JIT_MAX_BLOCK_STEPS ? address - 3 * VM_JIT_MAX_BLOCK_STEPS : 0; start <= last; ++start) {
+		if (!atomic_load_explicit(&jit->entries[start], memory_order_relaxed)) continue;
+		if (start + atomic_load_explicit(&jit->spans[start], memory_order_relaxed) <= address) continue;
+
+		// the code itself stays in the arena until it starts over, a core
+		// may still be returning through it
+		atomic_store_explicit(&jit->entries[start], NULL, memory_order_relaxed);
+		atomic_store_explicit(&jit->heat[start], 0, memory_order_relaxed);
+		invalidated = true;
+	}
+	mtx_unlock(&jit->lock);
+
+	return invalidated;
+}
+
+// Called from native code. Return values with bit 16 set tell the block that
+// the write dropped compiled code, which may include the block itself.
+
+static uint32_t vm_jit_write_byte(vm_state *vm, uint32_t address, uint32_t value) {
+	vm_store_byte(vm, address, value);
+	vm_decode_cache_note_write(vm->decode_cache, address, 1);
+	vm_idle_note_write(vm, address, 1);
+	return vm_jit_note_write(vm->jit, address, 1) << 16;
+}
+
+// like vm_jit_note_write for writes that may wrap around the end of memory
+static bool vm_jit_note_short_write(vm_jit *jit, uint16_t address, uint16_t length) {
+	uint16_t const before_wrap = address > 0x10000 - length ? 0x10000 - address : length;
+	bool invalidated = vm_jit_note_write(jit, address, before_wrap);
+	if (before_wrap < length) invalidated |= vm_jit_note_write(jit, 0, length - before_wrap);
+	return invalidated;
+}
+
+static uint32_t vm_jit_write_two_byte(vm_state *vm, uint32_t address, uint32_t value) {
+	vm_store_two_byte(vm, address, value);
+	vm_decode_cache_note_write(vm->decode_cache, address, 2);
+	vm_idle_note_write(vm, address, 2);
+	return vm_jit_note_short_write(vm->jit, address, 2) << 16;
+}
+
+static uint32_t vm_jit_write_four_byte(vm_state *vm, uint32_t address, uint32_t value) {
+	vm_write_four_byte(vm, address, value);
+	vm_decode_cache_note_write(vm->decode_cache, address, 4);
+	vm_idle_note_write(vm, address, 4);
+	return vm_jit_note_short_write(vm->jit, address, 4) << 16;
+}
+
+static uint32_t vm_jit_read_four_byte(vm_state *vm, uint32_t address) {
+	return vm_read_four_byte(vm, address);
+}
+
+static uint32_t vm_jit_fetch_add(vm_state *vm, uint32_t address, uint32_t value) {
+	uint8_t old = atomic_fetch_add_explicit(vm_atomic_byte(vm, address), (uint8_t)value, memory_order_relaxed);
+	vm_decode_cache_note_write(vm->decode_cache, address, 1);
+	vm_idle_note_write(vm, address, 1);
+	return old | vm_jit_note_write(vm->jit, address, 1) << 16;
+}
+
+// the 16 bit atomics are only called with even addresses, the blocks check
+static uint32_t vm_jit_fetch_add_two_byte(vm_state *vm, uint32_t address, uint32_t value) {
+	uint16_t old = atomic_fetch_add_explicit(vm_atomic_two_byte(vm, address), (uint16_t)value, memory_order_relaxed);
+	vm_decode_cache_note_write(vm->decode_cache, address, 2);
+	vm_idle_note_write(vm, address, 2);
+	return old | vm_jit_note_write(vm->jit, address, 2) << 16;
+}
+
+static uint32_t vm_jit_exchange_byte(vm_state *vm, uint32_t address, uint32_t value) {
+	uint8_t old = atomic_exchange_explicit(vm_atomic_byte(vm, address), (uint8_t)value, memory_order_relaxed);
+	vm_decode_cache_note_write(vm->decode_cache, address, 1);
+	vm_idle_note_write(vm, address, 1);
+	return old | vm_jit_note_write(vm->jit, address, 1) << 16;
+}
+
+static uint32_t vm_jit_exchange_two_byte(vm_state *vm, uint32_t address, uint32_t value) {
+	uint16_t old = atomic_exchange_explicit(vm_atomic_two_byte(vm, address), (uint16_t)value, memory_order_relaxed);
+	vm_decode_cache_note_write(vm->decode_cache, address, 2);
+	vm_idle_note_write(vm, address, 2);
+	return old | vm_jit_note_write(vm->jit, address, 2) << 16;
+}
+
+static uint32_t vm_jit_compare_and_swap_byte(vm_state *vm, uint32_t address, uint32_t expected, uint32_t desired) {
+	uint8_t old = expected;
+	if (!atomic_compare_exchange_strong_explicit(vm_atomic_byte(vm, address), &old, (uint8_t)desired, memory_order_relaxed, memory_order_relaxed))
+		return old;
+	vm_decode_cache_note_write(vm->decode_cache, address, 1);
+	vm_idle_note_write(vm, address, 1);
+	return old | vm_jit_note_write(vm->jit, address, 1) << 16;
+}
+
+static uint32_t vm_jit_compare_and_swap_two_byte(vm_state *vm, uint32_t address, uint32_t expected, uint32_t desired) {
+	uint16_t old = expected;
+	if (!atomic_compare_exchange_strong_explicit(vm_atomic_two_byte(vm, address), &old, (uint16_t)desired, memory_order_relaxed, memory_order_relaxed))
+		return old;
+	vm_decode_cache_note_write(vm->decode_cache, address, 2);
+	vm_idle_note_write(vm, address, 2);
+	return old | vm_jit_note_write(vm->jit, address, 2) << 16;
+}
+
+static uint32_t vm_jit_port_read(vm_state *vm, uint32_t port, uint32_t current) {
+	return vm->ports[port].read ? vm->ports[port].read(vm->ports[port].context, port) : current;
+}
+
+// returns exit, with VM_JIT_EXIT_STOP for ports the host wants to react to
+static uint32_t vm_jit_port_write(vm_state *vm, uint32_t port, uint32_t value, uint32_t exit) {
+	if (vm->ports[port].write) vm->ports[port].write(vm->ports[port].context, port, value);
+	return vm->ports[port].stop ? exit | VM_JIT_EXIT_STOP : exit;
+}
+
+static uint32_t vm_jit_popcount(vm_state *vm, uint32_t value) {
+	(void)vm;
+	return vm_popcount(value);
+}
+
+enum {
+	rax = 0, rcx = 1, rdx = 2, rbx = 3, rsp = 4, rbp = 5, rsi = 6, rdi = 7,
+	r12 = 12, r13 = 13, r14 = 14, r15 = 15,
+};
+
+static uint8_t const vm_jit_pinnable[] = { rbp, r13, r14, r15 };
+
+typedef struct vm_jit_emitter {
+	uint8_t *start, *cursor;
+	int8_t host[16]; // host register holding each guest register, -1 for ones left in memory
+
+	uint8_t *exits[2 * VM_JIT_MAX_BLOCK_STEPS + 2]; // rel32s to point at the epilogue
+	uint32_t exit_count;
+} vm_jit_emitter;
+
+static void emit_raw(vm_jit_emitter *e, uint8_t const *bytes, size_t count) {
+	memcpy(e->cursor, bytes, count);
+	e->cursor += count;
+}
+
+#define emit(e, ...) emit_raw(e, (uint8_t const[]){ __VA_ARGS__ }, sizeof((uint8_t const[]){ __VA_ARGS__ }))
+
+static void emit32(vm_jit_emitter *e, uint32_t v) { memcpy(e->cursor, &v, 4); e->cursor += 4; }
+static void emit64(vm_jit_emitter *e, uint64_t v) { memcpy(e->cursor, &v, 8); e->cursor += 8; }
+
+// scratch <- guest register (zero extended)
+static void emit_load(vm_jit_emitter *e, uint8_t scratch, uint8_t guest) {
+	int8_t host = e->host[guest];
+	if (host < 0) emit(e, 0x0f, 0xb7, 0x43 | scratch << 3, guest * 2); // movzx scratch, word [rbx + 2 * guest]
+	else if (host >= 8) emit(e, 0x41, 0x8b, 0xc0 | scratch << 3 | (host & 7)); // mov scratch, host
+	else emit(e, 0x8b, 0xc0 | scratch << 3 | host);
+}
+
+// guest register <- low 16 bits of scratch
+static void emit_store(vm_jit_emitter *e, uint8_t guest, uint8_t scratch) {
+	int8_t host = e->host[guest];
+	if (host < 0) emit(e, 0x66, 0x89, 0x43 | scratch << 3, guest * 2); // mov word [rbx + 2 * guest], scratch
+	else if (host >= 8) emit(e, 0x44, 0x0f, 0xb7, 0xc0 | (host & 7) << 3 | scratch); // movzx host, scratch
+	else emit(e, 0x0f, 0xb7, 0xc0 | host << 3 | scratch);
+}
+
+static void emit_mov_imm(vm_jit_emitter *e, uint8_t scratch, uint32_t imm) { emit(e, 0xb8 + scratch); emit32(e, imm); }
+
+// op dst, src for the "op r/m32, r32" family
+enum { x86_add = 0x01, x86_or = 0x09, x86_and = 0x21, x86_sub = 0x29, x86_xor = 0x31, x86_cmp = 0x39, x86_mov = 0x89, x86_test = 0x85 };
+static void emit_alu(vm_jit_emitter *e, uint8_t op, uint8_t dst, uint8_t src) { emit(e, op, 0xc0 | src << 3 | dst); }
+
+// op dst, imm32 for the 0x81 group
+enum { x86_imm_add = 0, x86_imm_or = 1, x86_imm_and = 4, x86_imm_sub = 5, x86_imm_xor = 6 };
+static void emit_alu_imm(vm_jit_emitter *e, uint8_t ext, uint8_t dst, uint32_t imm) { emit(e, 0x81, 0xc0 | ext << 3 | dst); emit32(e, imm); }
+
+// shifts of dst by cl or an immediate
+enum { x86_shl = 4, x86_shr = 5, x86_sar = 7 };
+static void emit_shift_cl(vm_jit_emitter *e, uint8_t ext, uint8_t dst) { emit(e, 0xd3, 0xc0 | ext << 3 | dst); }
+static void emit_shift_imm(vm_jit_emitter *e, uint8_t ext, uint8_t dst, uint8_t n) { emit(e, 0xc1, 0xc0 | ext << 3 | dst, n); }
+
+static void emit_movsx8(vm_jit_emitter *e, uint8_t dst, uint8_t src) { emit(e, 0x0f, 0xbe, 0xc0 | dst << 3 | src); }
+static void emit_movzx8(vm_jit_emitter *e, uint8_t dst, uint8_t src) { emit(e, 0x0f, 0xb6, 0xc0 | dst << 3 | src); }
+static void emit_movzx16(vm_jit_emitter *e, uint8_t dst, uint8_t src) { emit(e, 0x0f, 0xb7, 0xc0 | dst << 3 | src); }
+
+// dst <- memory[index], a byte or a little endian double byte (from the
+// mirror for its second byte at 0xffff)
+static void emit_read_byte(vm_jit_emitter *e, uint8_t dst, uint8_t index) { emit(e, 0x41, 0x0f, 0xb6, 0x04 | dst << 3, index << 3 | 4); }
+static void emit_read_two_byte(vm_jit_emitter *e, uint8_t dst, uint8_t index) { emit(e, 0x41, 0x0f, 0xb7, 0x04 | dst << 3, index << 3 | 4); }
+
+// calls fn(vm, esi, edx, ecx), the pinned registers are callee saved so they survive it
+static void emit_call(vm_jit_emitter *e, vm_state *vm, uint64_t fn) {
+	emit(e, 0x48, 0xbf); emit64(e, (uintptr_t)vm); // mov rdi, vm
+	emit(e, 0x48, 0xb8); emit64(e, fn);            // mov rax, fn
+	emit(e, 0xff, 0xd0);                           // call rax
+}
+
+static void emit_jump_to_epilogue(vm_jit_emitter *e) {
+	emit(e, 0xe9);
+	e->exits[e->exit_count++] = e->cursor;
+	emit32(e, 0);
+}
+
+static uint32_t vm_jit_exit_value(uint16_t pc, uint32_t steps, bool stop) {
+	return pc | steps << 16 | (stop ? VM_JIT_EXIT_STOP : 0);
+}
+
+static void emit_exit(vm_jit_emitter *e, uint16_t pc, uint32_t steps, bool stop) {
+	emit_mov_imm(e, rax, vm_jit_exit_value(pc, steps, stop));
+	emit_jump_to_epilogue(e);
+}
+
+// exit to the pc in ax
+static void emit_exit_dynamic(vm_jit_emitter *e, uint32_t steps) {
+	emit_movzx16(e, rax, rax);
+	emit_alu_imm(e, x86_imm_or, rax, vm_jit_exit_value(0, steps, false));
+	emit_jump_to_epilogue(e);
+}
+
+// leaves the block right after a store that dropped compiled code (bit 16 of eax)
+static void emit_exit_if_invalidated(vm_jit_emitter *e, uint16_t next_pc, uint32_t steps) {
+	emit(e, 0xa9); emit32(e, 1u << 16); // test eax, 1 << 16
+	emit(e, 0x74, 10);                  // jz past the exit
+	emit_exit(e, next_pc, steps, false);
+}
+
+// r15 += 2, then memory[r15] <- ecx
+static void emit_push_ecx(vm_jit_emitter *e, vm_state *vm) {
+	emit_load(e, rax, 15);
+	emit_alu_imm(e, x86_imm_add, rax, 2);
+	emit_movzx16(e, rax, rax);
+	emit_store(e, 15, rax);
+	emit_alu(e, x86_mov, rsi, rax);
+	emit_alu(e, x86_mov, rdx, rcx);
+	emit_call(e, vm, (uintptr_t)vm_jit_write_two_byte);
+}
+
+// eax <- memory[r15], then r15 -= 2
+static void emit_pop_eax(vm_jit_emitter *e) {
+	emit_load(e, rcx, 15);
+	emit_read_two_byte(e, rax, rcx);
+	emit_alu_imm(e, x86_imm_sub, rcx, 2);
+	emit_store(e, 15, rcx);
+}
+
+// R1:R2 <- eax, the high half into R1
+static void emit_store_pair(vm_jit_emitter *e, vm_decoded insn) {
+	emit_alu(e, x86_mov, rdx, rax);
+	emit_shift_imm(e, x86_shr, rdx, 16);
+	emit_store(e, insn.r1, rdx);
+	emit_store(e, insn.r2, rax);
+}
+
+// dst <- high:low, clobbers scratch
+static void emit_load_pair(vm_jit_emitter *e, uint8_t dst, uint8_t high, uint8_t low, uint8_t scratch) {
+	emit_load(e, dst, high);
+	emit_shift_imm(e, x86_shl, dst, 16);
+	emit_load(e, scratch, low);
+	emit_alu(e, x86_or, dst, scratch);
+}
+
+// R1 <- flag in dl, R2 <- !flag
+static void emit_store_comparison(vm_jit_emitter *e, vm_decoded insn) {
+	emit_movzx8(e, rdx, rdx);
+	emit_store(e, insn.r1, rdx);
+	emit_alu_imm(e, x86_imm_xor, rdx, 1);
+	emit_store(e, insn.r2, rdx);
+}
+
+// whether the rrrr ops that fault when R1 and R2 are the same register are
+// safe to compile, everything not listed here ends the block before it
+static bool vm_jit_can_compile(vm_decoded insn) {
+	switch (insn.handler) {
+	case vm_op_Add: case vm_op_Subtract:
+	case vm_op_Unsigned_Multiply: case vm_op_Signed_Multiply:
+	case vm_op_Increment: case vm_op_Decrement:
+	case vm_op_Compare_Signed: case vm_op_Compare_Unsigned: case vm_op_Compare_Equal:
+	case vm_op_Bit_Test_And_Set: case vm_op_Bit_Test_And_Clear:
+	case vm_op_Add_Pair: case vm_op_Subtract_Pair:
+	case vm_op_Shift_Left_Pair: case vm_op_Shift_Logical_Right_Pair:
+	case vm_op_Compare_Unsigned_Pair: case vm_op_Compare_Signed_Pair:
+	case vm_op_Read_Address_Four_Byte:
+		return insn.r1 != insn.r2;
+
+	case vm_op_Nop:
+	case vm_op_Load_Immediate_Byte: case vm_op_Shift_In_Byte:
+	case vm_op_Copy: case vm_op_Rotate_2: case vm_op_Rotate_3: case vm_op_Rotate_4:
+	case vm_op_Shift_Left: case vm_op_Shift_Logical_Right: case vm_op_Shift_Arithmetic_Right:
+	case vm_op_Branch_Immediate_Absolute: case vm_op_Branch_Immediate_Relative:
+	case vm_op_Branch_Absolute: case vm_op_Branch_Relative:
+	case vm_op_Skip_If_Zero: case vm_op_Skip_If_Non_Zero:
+	case vm_op_Read_Address_Byte: case vm_op_Read_Address_Two_Byte:
+	case vm_op_Write_Address_Byte: case vm_op_Write_Address_Two_Byte:
+	case vm_op_Port_Write: case vm_op_Port_Read:
+	case vm_op_Push: case vm_op_Pop:
+	case vm_op_Call_Immediate_Relative: case vm_op_Call_Immediate_Absolute:
+	case vm_op_Call_Relative: case vm_op_Call_Absolute:
+	case vm_op_Return:
+	case vm_op_Fetch_And_Add_Byte: case vm_op_Fetch_And_Add_Two_Byte:
+	case vm_op_Compare_And_Swap_Byte: case vm_op_Compare_And_Swap_Two_Byte:
+	case vm_op_Exchange_Byte: case vm_op_Exchange_Two_Byte:
+	case vm_op_Fence_Acquire: case vm_op_Fence_Release: case vm_op_Fence:
+	case vm_op_Write_Address_Four_Byte:
+	case vm_op_Population_Count: case vm_op_Count_Leading_Zeros: case vm_op_Count_Trailing_Zeros:
+	case vm_op_Byte_Swap:
+		return true;
+	}
+
+	return false;
+}
+
+static bool vm_jit_ends_block(uint8_t handler) {
+	switch (handler) {
+	case vm_op_Branch_Immediate_Absolute: case vm_op_Branch_Immediate_Relative:
+	case vm_op_Branch_Absolute: case vm_op_Branch_Relative:
+	case vm_op_Skip_If_Zero: case vm_op_Skip_If_Non_Zero:
+	case vm_op_Call_Immediate_Relative: case vm_op_Call_Immediate_Absolute:
+	case vm_op_Call_Relative: case vm_op_Call_Absolute:
+	case vm_op_Return:
+	case vm_op_Port_Write:
+		return true;
+	}
+	return false;
+}
+
+// emits one instruction, steps is how many the block has retired once it is
+// done. Has to match vm_interp.c exactly, including its quirks (e.g. sar, br
+// and smul only look at the low byte of their registers).
+static void emit_instruction(vm_jit_emitter *e, vm_state *vm, vm_decoded insn, uint16_t pc, uint32_t steps) {
+	uint16_t const next_pc = pc + 3;
+
+	switch (insn.handler) {
+	case vm_op_Nop: break;
+
+	case vm_op_Load_Immediate_Byte:
+		emit_mov_imm(e, rax, insn.b2);
+		emit_store(e, insn.r1, rax);
+		break;
+
+	case vm_op_Shift_In_Byte:
+		emit_load(e, rax, insn.r1);
+		emit_shift_imm(e, x86_shl, rax, 8);
+		emit_alu_imm(e, x86_imm_or, rax, insn.b2);
+		emit_store(e, insn.r1, rax);
+		break;
+
+	case vm_op_Copy:
+		emit_load(e, rax, insn.r2);
+		emit_store(e, insn.r1, rax);
+		break;
+
+	case vm_op_Rotate_2:
+		emit_load(e, rax, insn.r1);
+		emit_load(e, rcx, insn.r2);
+		emit_store(e, insn.r1, rcx);
+		emit_store(e, insn.r2, rax);
+		break;
+
+	case vm_op_Rotate_3:
+		emit_load(e, rax, insn.r1);
+		emit_load(e, rcx, insn.r2);
+		emit_load(e, rdx, insn.r3);
+		emit_store(e, insn.r1, rcx);
+		emit_store(e, insn.r2, rdx);
+		emit_store(e, insn.r3, rax);
+		break;
+
+	case vm_op_Rotate_4:
+		emit_load(e, rax, insn.r1);
+		emit_load(e, rcx, insn.r2);
+		emit_load(e, rdx, insn.r3);
+		emit_load(e, rsi, insn.r4);
+		emit_store(e, insn.r1, rcx);
+		emit_store(e, insn.r2, rdx);
+		emit_store(e, insn.r3, rsi);
+		emit_store(e, insn.r4, rax);
+		break;
+
+	case vm_op_Shift_Left:
+	case vm_op_Shift_Logical_Right:
+		emit_load(e, rax, insn.r1);
+		emit_load(e, rcx, insn.r2);
+		emit_shift_cl(e, insn.handler == vm_op_Shift_Left ? x86_shl : x86_shr, rax);
+		emit_store(e, insn.r1, rax);
+		break;
+
+	case vm_op_Shift_Arithmetic_Right:
+		emit_load(e, rax, insn.r1);
+		emit_load(e, rcx, insn.r2);
+		emit_movsx8(e, rdx, rax);
+		emit_shift_cl(e, x86_sar, rdx);
+		emit_movzx8(e, rdx, rdx);
+		emit_alu_imm(e, x86_imm_and, rax, 0xff00);
+		emit_alu(e, x86_or, rax, rdx);
+		emit_store(e, insn.r1, rax);
+		break;
+
+	case vm_op_Add:
+	case vm_op_Subtract:
+	case vm_op_Unsigned_Multiply:
+		emit_load(e, rax, insn.r3);
+		emit_load(e, rcx, insn.r4);
+		if (insn.handler == vm_op_Unsigned_Multiply) emit(e, 0x0f, 0xaf, 0xc1); // imul eax, ecx
+		else emit_alu(e, insn.handler == vm_op_Add ? x86_add : x86_sub, rax, rcx);
+		emit_store_pair(e, insn);
+		break;
+
+	case vm_op_Signed_Multiply:
+		emit_load(e, rax, insn.r3);
+		emit_load(e, rcx, insn.r4);
+		emit_movsx8(e, rax, rax);
+		emit_movsx8(e, rcx, rcx);
+		emit(e, 0x0f, 0xaf, 0xc1); // imul eax, ecx
+		emit_store_pair(e, insn);
+		break;
+
+	case vm_op_Increment:
+	case vm_op_Decrement:
+		emit_load(e, rax, insn.r2);
+		emit_alu_imm(e, insn.handler == vm_op_Increment ? x86_imm_add : x86_imm_sub, rax, insn.b2);
+		emit_store_pair(e, insn);
+		break;
+
+	case vm_op_Compare_Signed:
+	case vm_op_Compare_Unsigned:
+	case vm_op_Compare_Equal:
+		emit_load(e, rax, insn.r3);
+		emit_load(e, rcx, insn.r4);
+		if (insn.handler == vm_op_Compare_Signed) {
+			emit_movsx8(e, rax, rax);
+			emit_movsx8(e, rcx, rcx);
+		}
+		emit_alu(e, x86_cmp, rax, rcx);
+		switch (insn.handler) {
+		case vm_op_Compare_Signed:   emit(e, 0x0f, 0x9e, 0xc2); break; // setle dl
+		case vm_op_Compare_Unsigned: emit(e, 0x0f, 0x96, 0xc2); break; // setbe dl
+		default:                     emit(e, 0x0f, 0x94, 0xc2); break; // sete dl
+		}
+		emit_store_comparison(e, insn);
+		break;
+
+	// popcnt isn't in baseline x86-64, so that one goes through C
+	case vm_op_Population_Count:
+		emit_load(e, rsi, insn.r2);
+		emit_call(e, vm, (uintptr_t)vm_jit_popcount);
+		emit_store(e, insn.r1, rax);
+		break;
+
+	// bsf and bsr leave their destination alone for 0, so that is patched up
+	// with a cmovz
+	case vm_op_Count_Trailing_Zeros:
+		emit_load(e, rax, insn.r2);
+		emit_mov_imm(e, rcx, 16);
+		emit(e, 0x0f, 0xbc, 0xc0); // bsf eax, eax
+		emit(e, 0x0f, 0x44, 0xc1); // cmovz eax, ecx
+		emit_store(e, insn.r1, rax);
+		break;
+
+	case vm_op_Count_Leading_Zeros:
+		emit_load(e, rax, insn.r2);
+		emit_mov_imm(e, rcx, -1);
+		emit(e, 0x0f, 0xbd, 0xc0); // bsr eax, eax
+		emit(e, 0x0f, 0x44, 0xc1); // cmovz eax, ecx
+		emit(e, 0xf7, 0xd8);       // neg eax
+		emit_alu_imm(e, x86_imm_add, rax, 15);
+		emit_store(e, insn.r1, rax);
+		break;
+
+	case vm_op_Byte_Swap:
+		emit_load(e, rax, insn.r2);
+		emit(e, 0x66, 0xc1, 0xc0, 8); // rol ax, 8
+		emit_store(e, insn.r1, rax);
+		break;
+
+	case vm_op_Bit_Test_And_Set:
+	case vm_op_Bit_Test_And_Clear:
+		emit_load(e, rax, insn.r2);
+		emit_load(e, rcx, insn.r3);
+		emit_alu_imm(e, x86_imm_and, rcx, 15);
+		emit(e, 0x0f, insn.handler == vm_op_Bit_Test_And_Set ? 0xab : 0xb3, 0xc8); // bts/btr eax, ecx
+		emit(e, 0x0f, 0x92, 0xc2); // setc dl
+		emit_movzx8(e, rdx, rdx);
+		emit_store(e, insn.r1, rdx);
+		emit_store(e, insn.r2, rax);
+		break;
+
+	case vm_op_Add_Pair:
+	case vm_op_Subtract_Pair:
+		emit_load_pair(e, rax, insn.r1, insn.r2, rdx);
+		emit_load_pair(e, rcx, insn.r3, insn.r4, rdx);
+		emit_alu(e, insn.handler == vm_op_Add_Pair ? x86_add : x86_sub, rax, rcx);
+		emit_store_pair(e, insn);
+		break;
+
+	// x86 already takes 32 bit shift counts mod 32
+	case vm_op_Shift_Left_Pair:
+	case vm_op_Shift_Logical_Right_Pair:
+		emit_load_pair(e, rax, insn.r1, insn.r2, rdx);
+		emit_load(e, rcx, insn.r3);
+		emit_shift_cl(e, insn.handler == vm_op_Shift_Left_Pair ? x86_shl : x86_shr, rax);
+		emit_store_pair(e, insn);
+		break;
+
+	case vm_op_Compare_Unsigned_Pair:
+	case vm_op_Compare_Signed_Pair:
+		emit_load_pair(e, rax, insn.r1, insn.r2, rdx);
+		emit_load_pair(e, rcx, insn.r3, insn.r4, rdx);
+		emit_alu(e, x86_cmp, rax, rcx);
+		if (insn.handler == vm_op_Compare_Signed_Pair) emit(e, 0x0f, 0x9e, 0xc2); // setle dl
+		else emit(e, 0x0f, 0x96, 0xc2); // setbe dl
+		emit_store_comparison(e, insn);
+		break;
+
+	case vm_op_Read_Address_Four_Byte:
+		emit_load(e, rsi, insn.r3);
+		emit_call(e, vm, (uintptr_t)vm_jit_read_four_byte);
+		emit_store_pair(e, insn);
+		break;
+
+	case vm_op_Write_Address_Four_Byte:
+		emit_load(e, rsi, insn.r1);
+		emit_load_pair(e, rdx, insn.r2, insn.r3, rcx);
+		emit_call(e, vm, (uintptr_t)vm_jit_write_four_byte);
+		emit_exit_if_invalidated(e, next_pc, steps);
+		break;
+
+	case vm_op_Read_Address_Byte:
+	case vm_op_Read_Address_Two_Byte:
+		emit_load(e, rcx, insn.r2);
+		if (insn.handler == vm_op_Read_Address_Byte) emit_read_byte(e, rax, rcx);
+		else emit_read_two_byte(e, rax, rcx);
+		emit_store(e, insn.r1, rax);
+		break;
+
+	case vm_op_Write_Address_Byte:
+	case vm_op_Write_Address_Two_Byte:
+		emit_load(e, rsi, insn.r1);
+		emit_load(e, rdx, insn.r2);
+		emit_call(e, vm, insn.handler == vm_op_Write_Address_Byte ? (uintptr_t)vm_jit_write_byte : (uintptr_t)vm_jit_write_two_byte);
+		emit_exit_if_invalidated(e, next_pc, steps);
+		break;
+
+	case vm_op_Fetch_And_Add_Byte:
+	case vm_op_Fetch_And_Add_Two_Byte:
+	case vm_op_Exchange_Byte:
+	case vm_op_Exchange_Two_Byte:
+	case vm_op_Compare_And_Swap_Byte:
+	case vm_op_Compare_And_Swap_Two_Byte: {
+		bool const two_byte = insn.handler == vm_op_Fetch_And_Add_Two_Byte
+			|| insn.handler == vm_op_Exchange_Two_Byte
+			|| insn.handler == vm_op_Compare_And_Swap_Two_Byte;
+		emit_load(e, rsi, insn.r2);
+		if (two_byte) {
+			// leave misaligned ones for the interpreter to fault on
+			emit(e, 0xf7, 0xc6); emit32(e, 1); // test esi, 1
+			emit(e, 0x74, 10);                 // jz past the exit
+			emit_exit(e, pc, steps - 1, false);
+		}
+		emit_load(e, rdx, insn.r3);
+		uintptr_t fn;
+		switch (insn.handler) {
+		case vm_op_Fetch_And_Add_Byte:      fn = (uintptr_t)vm_jit_fetch_add; break;
+		case vm_op_Fetch_And_Add_Two_Byte:  fn = (uintptr_t)vm_jit_fetch_add_two_byte; break;
+		case vm_op_Exchange_Byte:           fn = (uintptr_t)vm_jit_exchange_byte; break;
+		case vm_op_Exchange_Two_Byte:       fn = (uintptr_t)vm_jit_exchange_two_byte; break;
+		case vm_op_Compare_And_Swap_Byte:   fn = (uintptr_t)vm_jit_compare_and_swap_byte; break;
+		default:                            fn = (uintptr_t)vm_jit_compare_and_swap_two_byte; break;
+		}
+		if (insn.handler == vm_op_Compare_And_Swap_Byte || insn.handler == vm_op_Compare_And_Swap_Two_Byte)
+			emit_load(e, rcx, insn.r4);
+		emit_call(e, vm, fn);
+		if (two_byte) emit_movzx16(e, rcx, rax);
+		else emit_movzx8(e, rcx, rax);
+		emit_store(e, insn.r1, rcx);
+		emit_exit_if_invalidated(e, next_pc, steps);
+		break;
+	}
+
+	// ordinary x86 loads and stores are already ordered enough for acquire
+	// and release, only a full fence needs an instruction
+	case vm_op_Fence_Acquire:
+	case vm_op_Fence_Release:
+		break;
+	case vm_op_Fence:
+		emit(e, 0x0f, 0xae, 0xf0); // mfence
+		break;
+
+	case vm_op_Push:
+		emit_load(e, rcx, insn.r1);
+		emit_push_ecx(e, vm);
+		emit_exit_if_invalidated(e, next_pc, steps);
+		break;
+
+	case vm_op_Pop:
+		emit_pop_eax(e);
+		emit_store(e, insn.r1, rax);
+		break;
+
+	case vm_op_Port_Read:
+		emit_mov_imm(e, rsi, insn.b2);
+		emit_load(e, rdx, insn.r1);
+		emit_call(e, vm, (uintptr_t)vm_jit_port_read);
+		emit_store(e, insn.r1, rax);
+		break;
+
+	case vm_op_Port_Write:
+		emit_mov_imm(e, rsi, insn.b2);
+		emit_load(e, rdx, insn.r1);
+		emit_mov_imm(e, rcx, vm_jit_exit_value(next_pc, steps, false));
+		emit_call(e, vm, (uintptr_t)vm_jit_port_write);
+		emit_jump_to_epilogue(e);
+		break;
+
+	case vm_op_Branch_Immediate_Absolute: emit_exit(e, insn.d, steps, false); break;
+	case vm_op_Branch_Immediate_Relative: emit_exit(e, pc + (int16_t)insn.d, steps, false); break;
+
+	case vm_op_Branch_Absolute:
+		emit_load(e, rax, insn.r1);
+		emit_exit_dynamic(e, steps);
+		break;
+
+	case vm_op_Branch_Relative:
+		emit_load(e, rax, insn.r1);
+		emit_movsx8(e, rax, rax);
+		emit_alu_imm(e, x86_imm_add, rax, pc);
+		emit_exit_dynamic(e, steps);
+		break;
+
+	case vm_op_Skip_If_Zero:
+	case vm_op_Skip_If_Non_Zero: {
+		uint32_t const skipped = vm_jit_exit_value(pc + 6, steps, false), not_skipped = vm_jit_exit_value(next_pc, steps, false);
+		bool const skip_if_zero = insn.handler == vm_op_Skip_If_Zero;
+		emit_load(e, rcx, insn.r1);
+		emit_mov_imm(e, rax, skip_if_zero ? skipped : not_skipped);
+		emit_mov_imm(e, rdx, skip_if_zero ? not_skipped : skipped);
+		emit_alu(e, x86_test, rcx, rcx);
+		emit(e, 0x0f, 0x45, 0xc2); // cmovnz eax, edx
+		emit_jump_to_epilogue(e);
+		break;
+	}
+
+	case vm_op_Call_Immediate_Relative:
+	case vm_op_Call_Immediate_Absolute:
+	case vm_op_Call_Relative:
+	case vm_op_Call_Absolute:
+		// the return address is pushed before R1 is read, like the interpreter does
+		emit_mov_imm(e, rcx, pc);
+		emit_push_ecx(e, vm);
+		switch (insn.handler) {
+		case vm_op_Call_Immediate_Relative: emit_exit(e, pc + insn.d, steps, false); break;
+		case vm_op_Call_Immediate_Absolute: emit_exit(e, insn.d, steps, false); break;
+		case vm_op_Call_Relative:
+			emit_load(e, rax, insn.r1);
+			emit_movsx8(e, rax, rax);
+			emit_alu_imm(e, x86_imm_add, rax, pc);
+			emit_exit_dynamic(e, steps);
+			break;
+		default:
+			emit_load(e, rax, insn.r1);
+			emit_exit_dynamic(e, steps);
+			break;
+		}
+		break;
+
+	case vm_op_Return:
+		emit_pop_eax(e);
+		emit_alu_imm(e, x86_imm_add, rax, 3);
+		emit_exit_dynamic(e, steps);
+		break;
+	}
+}
+
+// pins the guest registers the block uses the most
+static void vm_jit_pick_pinned(vm_jit_emitter *e, vm_decoded const *insns, uint32_t count) {
+	uint32_t uses[16] = { 0 };
+	for (uint32_t i = 0; i < count; ++i) {
+		switch (vm_op_encoding(insns[i].handler)) {
+		case vm_operands_rrrr: uses[insns[i].r4] += 1; // fallthrough
+		case vm_operands_rrr: uses[insns[i].r3] += 1; // fallthrough
+		case vm_operands_rrb: case vm_operands_rr: uses[insns[i].r2] += 1; // fallthrough
+		case vm_operands_rb: case vm_operands_r: uses[insns[i].r1] += 1; break;
+		case vm_operands_none: case vm_operands_bb: case vm_operands_d: break;
+		}
+		switch (insns[i].handler) {
+		case vm_op_Push: case vm_op_Pop: case vm_op_Return:
+		case vm_op_Call_Immediate_Relative: case vm_op_Call_Immediate_Absolute:
+		case vm_op_Call_Relative: case vm_op_Call_Absolute:
+			uses[15] += 2;
+			break;
+		}
+	}
+
+	for (uint8_t g = 0; g < 16; ++g)
+		e->host[g] = -1;
+
+	for (uint8_t h = 0; h < sizeof vm_jit_pinnable; ++h) {
+		uint8_t best = 0;
+		for (uint8_t g = 1; g < 16; ++g)
+			if (uses[g] > uses[best]) best = g;
+		// loading and storing it back costs about as much as one use in memory
+		if (uses[best] < 2) break;
+		e->host[best] = vm_jit_pinnable[h];
+		uses[best] = 0;
+	}
+}
+
+static void emit_prologue(vm_jit_emitter *e, vm_state *vm) {
+	emit(e, 0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57); // push rbx, rbp, r12-r15
+	emit(e, 0x48, 0x83, 0xec, 0x08);                                   // sub rsp, 8 (keeps calls 16 byte aligned)
+	emit(e, 0x48, 0x89, 0xfb);                                         // mov rbx, rdi
+	emit(e, 0x49, 0xbc); emit64(e, (uintptr_t)vm->memory);             // mov r12, vm->memory
+
+	for (uint8_t g = 0; g < 16; ++g) {
+		int8_t host = e->host[g];
+		if (host < 0) continue;
+		if (host >= 8) emit(e, 0x44);
+		emit(e, 0x0f, 0xb7, 0x43 | (host & 7) << 3, g * 2); // movzx host, word [rbx + 2 * g]
+	}
+}
+
+static void emit_epilogue(vm_jit_emitter *e) {
+	for (uint32_t i = 0; i < e->exit_count; ++i) {
+		int32_t rel = e->cursor - (e->exits[i] + 4);
+		memcpy(e->exits[i], &rel, sizeof rel);
+	}
+
+	for (uint8_t g = 0; g < 16; ++g) {
+		int8_t host = e->host[g];
+		if (host < 0) continue;
+		emit(e, 0x66);
+		if (host >= 8) emit(e, 0x44);
+		emit(e, 0x89, 0x43 | (host & 7) << 3, g * 2); // mov word [rbx + 2 * g], host
+	}
+
+	emit(e, 0x48, 0x83, 0xc4, 0x08);                                   // add rsp, 8
+	emit(e, 0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5d, 0x5b); // pop r15-r12, rbp, rbx
+	emit(e, 0xc3);                                                     // ret
+}
+
+// Drops every block and, unless another thread is running compiled code
+// (the caller itself is in vm_jit_enter), empties the arena. Called with
+// the lock held, returns whether there is room again.
+static bool vm_jit_reset(vm_jit *jit) {
+	for (uint32_t i = 0; i < 0x10000; ++i)
+		atomic_store_explicit(&jit->entries[i], NULL, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&jit->inside, memory_order_acquire) > 1)
+		return false;
+
+	for (uint32_t i = 0; i < 0x100; ++i)
+		atomic_store_explicit(&jit->region_has_code[i], false, memory_order_relaxed);
+	jit->arena_used = 0;
+	return true;
+}
+
+// translates the block starting at pc, returns NULL when its first
+// instruction can't be compiled (giving up on pc) or there is no room yet
+static void *vm_jit_compile(vm_state *vm, vm_jit *jit, uint16_t pc) {
+	void *entry = atomic_load_explicit(&jit->entries[pc], memory_order_relaxed);
+	if (entry) return entry; // someone else got here first
+
+	if (VM_JIT_ARENA_SIZE - jit->arena_used < VM_JIT_MAX_BLOCK_CODE && !vm_jit_reset(jit)) {
+		// try again once it has cooled down and heated up again
+		atomic_store_explicit(&jit->heat[pc], 0, memory_order_relaxed);
+		return NULL;
+	}
+
+	// flag the regions before reading the code, so a write that lands while
+	// we are compiling still gets to invalidate the block
+	uint32_t const max_span = pc + 3 * VM_JIT_MAX_BLOCK_STEPS <= 0x10000 ? 3 * VM_JIT_MAX_BLOCK_STEPS : (0x10000 - pc) / 3 * 3;
+	for (uint32_t region = pc >> 8; region <= (pc + max_span - 1) >> 8 && region < 0x100; ++region)
+		atomic_store_explicit(&jit->region_has_code[region], true, memory_order_seq_cst);
+
+	vm_decoded insns[VM_JIT_MAX_BLOCK_STEPS];
+	uint32_t count = 0;
+	bool terminated = false;
+	while (count < VM_JIT_MAX_BLOCK_STEPS && 3 * (count + 1) <= max_span) {
+		vm_decoded insn = vm_decode(vm, pc + 3 * count);
+		if (!vm_jit_can_compile(insn)) break;
+		insns[count++] = insn;
+		if (vm_jit_ends_block(insn.handler)) { terminated = true; break; }
+	}
+	if (count == 0) {
+		atomic_store_explicit(&jit->heat[pc], VM_JIT_GAVE_UP, memory_order_relaxed);
+		return NULL;
+	}
+
+	vm_jit_emitter e = { .start = jit->arena + jit->arena_used, .exit_count = 0 };
+	e.cursor = e.start;
+	vm_jit_pick_pinned(&e, insns, count);
+
+	emit_prologue(&e, vm);
+	for (uint32_t i = 0; i < count; ++i)
+		emit_instruction(&e, vm, insns[i], pc + 3 * i, i + 1);
+	if (!terminated)
+		emit_exit(&e, pc + 3 * count, count, false);
+	emit_epilogue(&e);
+
+	// the same bytes, where they can be run
+	entry = jit->code + (e.start - jit->arena);
+	jit->arena_used += e.cursor - e.start;
+	atomic_store_explicit(&jit->spans[pc], 3 * count, memory_order_relaxed);
+	atomic_store_explicit(&jit->entries[pc], entry, memory_order_release);
+	atomic_fetch_add_explicit(&jit->block_count, 1, memory_order_relaxed);
+	return entry;
+}
+
+static vm_jit_block vm_jit_block_at(vm_state *vm, vm_jit *jit, uint16_t pc) {
+	void *entry = atomic_load_explicit(&jit->entries[pc], memory_order_acquire);
+
+	if (!entry) {
+		uint8_t heat = atomic_load_explicit(&jit->heat[pc], memory_order_relaxed);
+		if (heat == VM_JIT_GAVE_UP) return NULL;
+		if (heat + 1 < VM_JIT_HOT) {
+			atomic_store_explicit(&jit->heat[pc], heat + 1, memory_order_relaxed);
+			return NULL;
+		}
+
+		mtx_lock(&jit->lock);
+		entry = vm_jit_compile(vm, jit, pc);
+		mtx_unlock(&jit->lock);
+		if (!entry) return NULL;
+	}
+
+	vm_jit_block block;
+	memcpy(&block, &entry, sizeof block);
+	return block;
+}
+
+#undef emit
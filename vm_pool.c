@@ -0,0 +1,362 @@
+#include "vm_pool.h"
+#include "host.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <time.h>
+
+typedef enum vm_instance_status {
+	vm_instance_new,      // not started yet
+	vm_instance_queued,   // waiting in the run queue
+	vm_instance_running,  // a thread is running one of its cores
+	vm_instance_sleeping, // every core is parked, out of the queue until woken
+	vm_instance_exited,
+} vm_instance_status;
+
+typedef struct vm_pool_slab {
+	struct vm_pool_slab *next;
+	vm_instance instances[VM_POOL_SLAB_SIZE];
+} vm_pool_slab;
+
+// idle threads look at sleeping instances this often, in case a write that
+// should have woken one raced with its core parking in an idle loop
+#define VM_POOL_RECHECK_NS 10000000
+
+struct vm_pool {
+	uint32_t quantum;
+	uint16_t thread_count;
+	thrd_t *threads;
+
+	// everything below is under lock
+	mtx_t lock;
+	cnd_t work; // signalled when the queue gets an instance or the pool shuts down
+	cnd_t exited; // signalled when an instance exits
+	bool shutting_down;
+	vm_instance *queue_head, *queue_tail;
+	vm_instance *started; // every instance started and not exited yet
+	vm_instance *free;
+	vm_pool_slab *slabs;
+};
+
+static void vm_pool_push(vm_pool *pool, vm_instance *instance) {
+	instance->queued_next = NULL;
+	if (pool->queue_tail) pool->queue_tail->queued_next = instance;
+	else pool->queue_head = instance;
+	pool->queue_tail = instance;
+	cnd_signal(&pool->work);
+}
+
+static vm_instance *vm_pool_pop(vm_pool *pool) {
+	vm_instance *instance = pool->queue_head;
+	if (!instance) return NULL;
+	pool->queue_head = instance->queued_next;
+	if (!pool->queue_head) pool->queue_tail = NULL;
+	return instance;
+}
+
+// puts a sleeping instance back in the queue, unless someone beat us to it
+static void vm_pool_wake(vm_instance *instance, bool locked) {
+	uint8_t sleeping = vm_instance_sleeping;
+	if (!atomic_compare_exchange_strong(&instance->status, &sleeping, vm_instance_queued))
+		return;
+	if (!locked) mtx_lock(&instance->pool->lock);
+	vm_pool_push(instance->pool, instance);
+	if (!locked) mtx_unlock(&instance->pool->lock);
+}
+
+static void vm_pool_on_wake(vm_state *vm) {
+	vm_pool_wake((vm_instance *)vm, false);
+}
+
+static bool vm_pool_any_awake(vm_instance const *instance) {
+	for (uint16_t i = 0; i < instance->vm.core_count; ++i)
+		if (!vm_core_parked(&instance->vm.cores[i]))
+			return true;
+	return false;
+}
+
+static void vm_pool_recheck(vm_pool *pool) {
+	for (vm_instance *instance = pool->started; instance; instance = instance->next) {
+		if (atomic_load(&instance->status) != vm_instance_sleeping) continue;
+		bool awake = false;
+		for (uint16_t i = 0; i < instance->vm.core_count; ++i)
+			awake |= vm_recheck_idle(&instance->vm, i);
+		if (awake) vm_pool_wake(instance, true);
+	}
+}
+
+typedef enum vm_pool_outcome {
+	vm_pool_again, // back in the queue
+	vm_pool_slept,
+	vm_pool_exit,
+} vm_pool_outcome;
+
+// runs the next core that isn't parked for a quantum
+static vm_pool_outcome vm_pool_turn(vm_pool *pool, vm_instance *instance) {
+	if (atomic_load(&instance->stopping))
+		return vm_pool_exit;
+
+	vm_state *vm = &instance->vm;
+	for (uint16_t tried = 0; tried < vm->core_count; ++tried) {
+		uint16_t const core = instance->next_core;
+		instance->next_core = (core + 1) % vm->core_count;
+		if (vm_core_parked(&vm->cores[core])) continue;
+
+		if (vm_run(vm, core, pool->quantum, NULL) == vm_run_faulted) {
+			instance->faulted_core = core;
+			return vm_pool_exit;
+		}
+		return vm_pool_again;
+	}
+
+	// Every core is parked. A wake up from here on finds us sleeping and
+	// requeues us, one from before is seen by looking at the cores again.
+	atomic_store(&instance->status, vm_instance_sleeping);
+	atomic_thread_fence(memory_order_seq_cst);
+	if (vm_pool_any_awake(instance) || atomic_load(&instance->stopping)) {
+		uint8_t sleeping = vm_instance_sleeping;
+		if (atomic_compare_exchange_strong(&instance->status, &sleeping, vm_instance_running))
+			return vm_pool_again;
+	}
+	return vm_pool_slept;
+}
+
+static int vm_pool_thread(void *v_pool) {
+	vm_pool *pool = v_pool;
+
+	mtx_lock(&pool->lock);
+	for (;;) {
+		vm_instance *instance = vm_pool_pop(pool);
+		if (!instance) {
+			if (pool->shutting_down) break;
+
+			struct timespec until;
+			timespec_get(&until, TIME_UTC);
+			until.tv_nsec += VM_POOL_RECHECK_NS;
+			if (until.tv_nsec >= 1000000000) {
+				until.tv_sec += 1;
+				until.tv_nsec -= 1000000000;
+			}
+			if (cnd_timedwait(&pool->work, &pool->lock, &until) == thrd_timedout)
+				vm_pool_recheck(pool);
+			continue;
+		}
+
+		atomic_store(&instance->status, vm_instance_running);
+		mtx_unlock(&pool->lock);
+		vm_pool_outcome outcome = vm_pool_turn(pool, instance);
+		mtx_lock(&pool->lock);
+
+		if (outcome == vm_pool_again) {
+			atomic_store(&instance->status, vm_instance_queued);
+			vm_pool_push(pool, instance);
+		} else if (outcome == vm_pool_exit) {
+			atomic_store(&instance->status, vm_instance_exited);
+			if (instance->previous) instance->previous->next = instance->next;
+			else pool->started = instance->next;
+			if (instance->next) instance->next->previous = instance->previous;
+			instance->next = instance->previous = NULL;
+
+			// on_exit may free the instance, and vm_pool_wait may be
+			// waiting on it
+			mtx_unlock(&pool->lock);
+			if (instance->on_exit) instance->on_exit(instance);
+			mtx_lock(&pool->lock);
+			cnd_broadcast(&pool->exited);
+		}
+	}
+	mtx_unlock(&pool->lock);
+
+	return 0;
+}
+
+vm_pool *vm_pool_create(uint16_t thread_count, uint32_t quantum) {
+	vm_pool *pool = calloc(1, sizeof *pool);
+	if (!pool) return NULL;
+	pool->quantum = quantum;
+	pool->threads = calloc(thread_count, sizeof *pool->threads);
+	if (!pool->threads) goto fail_threads;
+	if (mtx_init(&pool->lock, mtx_plain) != thrd_success) goto fail_lock;
+	if (cnd_init(&pool->work) != thrd_success) goto fail_work;
+	if (cnd_init(&pool->exited) != thrd_success) goto fail_exited;
+
+	for (; pool->thread_count < thread_count; ++pool->thread_count) {
+		if (thrd_create(&pool->threads[pool->thread_count], vm_pool_thread, pool) != thrd_success) {
+			vm_pool_destroy(pool);
+			return NULL;
+		}
+	}
+	return pool;
+
+fail_exited: cnd_destroy(&pool->work);
+fail_work: mtx_destroy(&pool->lock);
+fail_lock: free(pool->threads);
+fail_threads: free(pool);
+	return NULL;
+}
+
+void vm_pool_destroy(vm_pool *pool) {
+	mtx_lock(&pool->lock);
+	for (vm_instance *instance = pool->started; instance; instance = instance->next) {
+		atomic_store(&instance->stopping, true);
+		vm_pool_wake(instance, true);
+	}
+	pool->shutting_down = true;
+	cnd_broadcast(&pool->work);
+	mtx_unlock(&pool->lock);
+
+	// threads only leave once the queue is empty, by then every stopped
+	// instance has exited
+	for (uint16_t i = 0; i < pool->thread_count; ++i)
+		thrd_join(pool->threads[i], NULL);
+
+	for (vm_pool_slab *slab = pool->slabs, *next; slab; slab = next) {
+		next = slab->next;
+		// instances the host didn't free
+		for (uint16_t i = 0; i < VM_POOL_SLAB_SIZE; ++i)
+			if (slab->instances[i].vm.cores)
+				vm_pool_free_instance(&slab->instances[i]);
+		free(slab);
+	}
+	cnd_destroy(&pool->exited);
+	cnd_destroy(&pool->work);
+	mtx_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool);
+}
+
+// a new instance with the given memory, which it frees on failure
+static vm_instance *vm_pool_new_instance_with(vm_pool *pool, uint16_t core_count, uint8_t *memory) {
+	vm_core *cores = aligned_alloc(VM_CACHE_LINE, core_count * sizeof(vm_core));
+	if (!cores) {
+		host_unmap_memory(memory, VM_MEMORY_SIZE);
+		return NULL;
+	}
+
+	mtx_lock(&pool->lock);
+	if (!pool->free) {
+		// slabs are only given back with the pool, instances in them are
+		// reused
+		// aligned like the vm_state in each instance
+		vm_pool_slab *slab = aligned_alloc(VM_CACHE_LINE, sizeof *slab);
+		if (!slab) {
+			mtx_unlock(&pool->lock);
+			free(cores);
+			host_unmap_memory(memory, VM_MEMORY_SIZE);
+			return NULL;
+		}
+		memset(slab, 0, sizeof *slab);
+		slab->next = pool->slabs;
+		pool->slabs = slab;
+		for (uint16_t i = 0; i < VM_POOL_SLAB_SIZE; ++i) {
+			slab->instances[i].next = pool->free;
+			pool->free = &slab->instances[i];
+		}
+	}
+	vm_instance *instance = pool->free;
+	pool->free = instance->next;
+	mtx_unlock(&pool->lock);
+
+	memset(cores, 0, core_count * sizeof(vm_core));
+	vm_init(&instance->vm, core_count, cores, memory);
+	instance->vm.on_wake = vm_pool_on_wake;
+	instance->context = NULL;
+	instance->on_exit = NULL;
+	instance->faulted_core = -1;
+	instance->pool = pool;
+	atomic_init(&instance->status, vm_instance_new);
+	atomic_init(&instance->stopping, false);
+	instance->next_core = 0;
+	instance->image = -1;
+	instance->queued_next = instance->next = instance->previous = NULL;
+	return instance;
+}
+
+vm_instance *vm_pool_new_instance(vm_pool *pool, uint16_t core_count) {
+	uint8_t *memory = host_map_memory(VM_MEMORY_SIZE);
+	if (!memory) return NULL;
+	return vm_pool_new_instance_with(pool, core_count, memory);
+}
+
+bool vm_pool_make_template(vm_instance *template) {
+	if (template->image >= 0) return true;
+	int const image = host_image_create(template->vm.memory, VM_MEMORY_SIZE);
+	if (image < 0) return false;
+	// and share the image with the forks rather than keep a copy of it
+	uint8_t *memory = host_image_fork(image, VM_MEMORY_SIZE);
+	if (!memory) {
+		host_image_destroy(image);
+		return false;
+	}
+	host_unmap_memory(template->vm.memory, VM_MEMORY_SIZE);
+	template->vm.memory = memory;
+	template->image = image;
+	return true;
+}
+
+vm_instance *vm_pool_fork(vm_instance *template) {
+	uint8_t *memory = NULL;
+	if (template->image >= 0)
+		memory = host_image_fork(template->image, VM_MEMORY_SIZE);
+	if (!memory) {
+		memory = host_map_memory(VM_MEMORY_SIZE);
+		if (!memory) return NULL;
+		memcpy(memory, template->vm.memory, VM_MEMORY_SIZE);
+	}
+
+	vm_state const *from = &template->vm;
+	vm_instance *instance = vm_pool_new_instance_with(template->pool, from->core_count, memory);
+	if (!instance) return NULL;
+	vm_state *to = &instance->vm;
+	for (uint16_t i = 0; i < from->core_count; ++i) {
+		to->cores[i].pc = from->cores[i].pc;
+		memcpy(to->cores[i].registers, from->cores[i].registers, sizeof to->cores[i].registers);
+	}
+	memcpy(to->ports, from->ports, sizeof to->ports);
+	to->dispatch = from->dispatch;
+	to->idle_parking = from->idle_parking;
+	instance->context = template->context;
+	instance->on_exit = template->on_exit;
+	return instance;
+}
+
+void vm_pool_start(vm_instance *instance) {
+	vm_pool *pool = instance->pool;
+	mtx_lock(&pool->lock);
+	instance->previous = NULL;
+	instance->next = pool->started;
+	if (pool->started) pool->started->previous = instance;
+	pool->started = instance;
+	atomic_store(&instance->status, vm_instance_queued);
+	vm_pool_push(pool, instance);
+	mtx_unlock(&pool->lock);
+}
+
+void vm_pool_stop(vm_instance *instance) {
+	atomic_store(&instance->stopping, true);
+	vm_pool_wake(instance, false);
+}
+
+void vm_pool_free_instance(vm_instance *instance) {
+	vm_pool *pool = instance->pool;
+	vm_disable_jit(&instance->vm);
+	vm_disable_decode_cache(&instance->vm);
+	free(instance->vm.cores);
+	instance->vm.cores = NULL;
+	host_unmap_memory(instance->vm.memory, VM_MEMORY_SIZE);
+	if (instance->image >= 0)
+		host_image_destroy(instance->image);
+
+	mtx_lock(&pool->lock);
+	instance->next = pool->free;
+	pool->free = instance;
+	mtx_unlock(&pool->lock);
+}
+
+void vm_pool_wait(vm_pool *pool) {
+	mtx_lock(&pool->lock);
+	while (pool->started)
+		cnd_wait(&pool->exited, &pool->lock);
+	mtx_unlock(&pool->lock);
+}
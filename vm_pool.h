@@ -0,0 +1,72 @@
+#ifndef VM_POOL_H
+#define VM_POOL_H
+
+// Runs many independent machines on one set of host threads. Each instance
+// is a whole vm_state with memory, ports and cores of its own, allocated
+// from slabs of VM_POOL_SLAB_SIZE instances that are reused after
+// vm_pool_free_instance. Instances that start from the same image can be
+// forked from a template, sharing the pages none of them write.
+//
+// Threads take instances from a queue and run one of their cores (in
+// turn) for a quantum before putting them back. Instances whose cores are
+// all parked leave the queue until a notify or a write wakes one of them,
+// or vm_pool_stop is called on them. An instance exits when it is stopped
+// or one of its cores faults.
+
+#include "vm.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define VM_POOL_SLAB_SIZE 16
+
+typedef struct vm_pool vm_pool;
+typedef struct vm_instance vm_instance;
+
+struct vm_instance {
+	vm_state vm; // first, so that vm callbacks can find the instance
+	void *context; // for the host, e.g. the state of the instance's ports
+	void (*on_exit)(vm_instance *); // called from a pool thread when the instance exits, may be NULL
+	int32_t faulted_core; // set before on_exit, -1 if the instance was stopped
+
+	// the rest belongs to the pool
+	vm_pool *pool;
+	_Atomic uint8_t status;
+	_Atomic bool stopping;
+	uint16_t next_core;
+	int image; // of a template, -1 for other instances
+	vm_instance *queued_next; // in the run queue
+	vm_instance *next, *previous; // in the free list or the list of started instances
+};
+
+// NULL if out of memory or the threads could not be started
+vm_pool *vm_pool_create(uint16_t thread_count, uint32_t quantum);
+// stops every instance that is still running, then the threads
+void vm_pool_destroy(vm_pool *);
+
+// A vm_init'd instance with core_count cores for the host to load and
+// register ports on before vm_pool_start. NULL if out of memory.
+vm_instance *vm_pool_new_instance(vm_pool *, uint16_t core_count);
+void vm_pool_start(vm_instance *);
+
+// Turns a loaded instance into a template by moving its memory to a
+// host_image. Its memory is the same afterwards, but changes to it no
+// longer reach forks. False if the host can't share memory, vm_pool_fork
+// copies it then.
+bool vm_pool_make_template(vm_instance *);
+// A new instance with the cores, ports and settings of another that isn't
+// running. It gets its memory copy-on-write from a template, or copies it
+// otherwise. The host usually gives it a context and ports of its own.
+// NULL if out of memory.
+vm_instance *vm_pool_fork(vm_instance *);
+// makes the instance exit after its current quantum, callable from
+// anywhere, its own port handlers included
+void vm_pool_stop(vm_instance *);
+// for instances that were never started or have exited, on_exit may call it
+void vm_pool_free_instance(vm_instance *);
+
+// blocks until every started instance has exited
+void vm_pool_wait(vm_pool *);
+
+#endif // VM_POOL_H
@@ -1,16 +1,29 @@
+#include "host.h"
+
 #include <stdlib.h>
 
-void read_file_to_vm_memory(vm_state *vm, char const *path) {
+// images leave the last byte of memory alone, both loaders take at most this
+#define VM_IMAGE_MAX_SIZE UINT16_MAX
+
+static void report_too_large(void) {
+	fprintf(stderr, "This file is too large (should be at most %u bytes).\n", VM_IMAGE_MAX_SIZE);
+}
+
+// returns how many bytes the file had
+size_t read_file_to_vm_memory(vm_state *vm, char const *path) {
 	FILE *file = fopen(path, "rb");
 	if (!file) {
 		fprintf(stderr, "Could not open file %s.\n", path);
 		exit(1);
 	}
 
-	for (uint8_t *cursor = &vm->memory[0];;) {
-		size_t remaining = &vm->memory[0] + sizeof(vm->memory) - cursor;
-		if (remaining == 0 && !feof(file)) {
-			fprintf(stderr, "This file is too large (should be less than 65536 bytes).\n");
+	uint8_t *const end = &vm->memory[VM_IMAGE_MAX_SIZE];
+	uint8_t *cursor = &vm->memory[0];
+	for (;;) {
+		size_t remaining = end - cursor;
+		// a file that fills the image exactly hasn't hit its end yet
+		if (remaining == 0 && fgetc(file) != EOF) {
+			report_too_large();
 			fclose(file);
 			exit(1);
 		}
@@ -28,4 +41,29 @@ void read_file_to_vm_memory(vm_state *vm, char const *path) {
 		cursor += result;
 	}
 	fclose(file);
+
+	return cursor - &vm->memory[0];
+}
+
+// Like read_file_to_vm_memory, but maps the file as the start of memory
+// rather than copying it, so until the machine writes to them its pages are
+// the page cache's (and shared with anyone else running the file). Memory
+// has to come from host_map_memory. Files that can't be mapped, like pipes,
+// are read instead.
+size_t map_file_to_vm_memory(vm_state *vm, char const *path) {
+	size_t length = 0;
+	switch (host_map_file(path, vm->memory, VM_IMAGE_MAX_SIZE, &length)) {
+	case host_map_ok: return length;
+	case host_map_unavailable: return read_file_to_vm_memory(vm, path);
+	case host_map_cant_open:
+		fprintf(stderr, "Could not open file %s.\n", path);
+		break;
+	case host_map_too_large:
+		report_too_large();
+		break;
+	case host_map_failed:
+		fprintf(stderr, "There was an error reading the file.\n");
+		break;
+	}
+	exit(1);
 }